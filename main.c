@@ -6,7 +6,7 @@
  * - Klavye (DEL, ABC/abc/123)
  * - WiFi ayarlari (tarama + sifre, baglanti testi)
  * - Telefon / API (telefon basinda otomatik '+')
- * - RFID (MFRC522, ayri SPI pinleri):
+ * - RFID (MFRC522, ayri SPI hatti):
  *    - Yonetici kart kaydetme
  *    - Sofor kart + plaka eslestirme
  * - Factory Reset (NVS sil + reset)
@@ -19,12 +19,14 @@
 #include <Preferences.h>
 #include <WiFi.h>
 #include <MFRC522.h>
-#include <HardwareSerial.h>
+#include "driver/uart.h"
 #include <ctype.h>
 #include <time.h>
 #include <math.h>
+#include <atomic>
 #include <esp32-hal-psram.h>
 #include "nvs_flash.h"
+#include "esp_partition.h"
 
 // -----------------------------------------------------------------------------
 // Sabitler / Donanım Pinleri
@@ -47,14 +49,18 @@
 #define TFT_MOSI 23
 #define TFT_CS   12
 
-// RFID pinleri (ayri SPI pinleri)
+// RFID pinleri. RFID kendi SPI donanimini kullanir: MFRC522 kutuphanesi
+// Arduino'nun global SPI nesnesine (VSPI) bagli oldugu icin ekran ve
+// dokunmatik TFT_eSPI'nin HSPI portuna alinir (User_Setup: USE_HSPI_PORT).
+// Iki hat birbirinden bagimsiz; pin degistirme / SPI.end() yok.
 #define RFID_SCK   25
 #define RFID_MISO  27
 #define RFID_MOSI  26
 #define RFID_SS    15
 #define RFID_RST   4
+#define RFID_IRQ   -1   // MFRC522 IRQ pini; bagli degilse -1 (sadece periyodik sorgu)
 
-// RS485 pinleri
+// RS485 pinleri (DE/RE, UART'in RTS cikisi olarak donanimca surulur)
 #define RS485_TX_PIN   22
 #define RS485_RX_PIN   21
 #define RS485_REDE_PIN 13
@@ -78,47 +84,217 @@
 // Ekran / Dokunmatik / RFID Nesneleri
 // -----------------------------------------------------------------------------
 TFT_eSPI tft = TFT_eSPI();
-TFT_eSprite spr = TFT_eSprite(&tft);
+
+// Sprite'ta degisen bolgeler; sprPresent() sadece bunlari SPI'dan gonderir.
+// Tum ekrani silen cizimler sprClear() ile tam ekrani, kismi guncellemeler
+// (saat, tus vurgusu, sayac satiri) kendi dikdortgenlerini isaretler.
+#define SPR_DIRTY_MAX 8
+
+struct SprRect
+{
+  int16_t x0, y0, x1, y1;   // x1/y1 haric
+};
+
+// Ekran tuvali: cizim fonksiyonlari `spr` uzerinden cizer, iki mod vardir.
+// - Tam kare: PSRAM'de tam ekran sprite, cagrilar dogrudan ona gider.
+// - Serit: cagrilar display list'e kaydedilir. sprPresent() kirli bolgeleri
+//   dahili SRAM'deki LCD_BAND_LINES satirlik serit sprite'inda listeyi
+//   tekrar oynatarak cizer ve DMA ile gonderir; PSRAM'e hic yazilmaz.
+// Tam kare sprite ayrilamazsa (PSRAM yok) serit moduna dusulur.
+const bool LCD_BAND_RENDER = false;
+#define LCD_BAND_LINES  24          // 320 x 24 x 2 = 15 KB dahili RAM
+#define DL_MAX_OPS      384
+#define DL_TEXT_POOL    4096
+
+enum DlOpKind : uint8_t
+{
+  DL_FILL_RECT = 0,
+  DL_FILL_RRECT,
+  DL_DRAW_RRECT,
+  DL_LINE,
+  DL_TEXT
+};
+
+struct DlOp
+{
+  DlOpKind kind;
+  uint8_t  font, size, datum;   // DL_TEXT: kayit anindaki yazi durumu
+  int16_t  x, y, w, h;          // DL_LINE: (x, y) -> (w, h); DL_TEXT: capa noktasi
+  uint16_t r;                   // kose yaricapi / DL_TEXT: havuzdaki offset
+  uint16_t color, bg;
+  SprRect  box;                 // etkiledigi bolge (serit secimi + ortme)
+};
+
+class ScreenCanvas
+{
+public:
+  explicit ScreenCanvas(TFT_eSprite *target) : _spr(target) {}
+
+  bool begin(int16_t w, int16_t h, bool bands);
+  bool banded() const { return _bands; }
+
+  int16_t width()  const { return _bands ? _w : _spr->width(); }
+  int16_t height() const { return _bands ? _h : _spr->height(); }
+
+  void fillSprite(uint16_t color);
+  void fillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color);
+  void fillRoundRect(int32_t x, int32_t y, int32_t w, int32_t h, int32_t r, uint32_t color);
+  void drawRoundRect(int32_t x, int32_t y, int32_t w, int32_t h, int32_t r, uint32_t color);
+  void drawLine(int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint32_t color);
+
+  void setTextFont(uint8_t font);
+  void setTextSize(uint8_t size);
+  void setTextDatum(uint8_t datum);
+  void setTextColor(uint16_t color);
+  void setTextColor(uint16_t color, uint16_t bg);
+  int16_t fontHeight();
+  int16_t textWidth(const char *text);
+  void drawString(const char *text, int32_t x, int32_t y);
+  void drawString(const String &text, int32_t x, int32_t y) { drawString(text.c_str(), x, y); }
+
+  void renderBand(TFT_eSprite &band, int16_t bandY);
+
+private:
+  void applyTextState();
+  void addOp(const DlOp &op, bool opaque);
+  bool addText(const char *text, uint16_t len, uint16_t &offset);
+  void compactPool();
+
+  TFT_eSprite *_spr;          // tam kare sprite veya serit sprite'i
+  bool         _bands = false;
+  int16_t      _w = 0, _h = 0;
+
+  // Yazi durumu (serit modunda kaydedilir, olcum icin _spr'a uygulanir)
+  uint8_t      _font = 1, _size = 1, _datum = TL_DATUM;
+  uint16_t     _fg = TFT_WHITE, _bg = TFT_WHITE;
+
+  DlOp        *_ops = nullptr;
+  uint16_t     _opCount = 0;
+  char        *_pool = nullptr;
+  uint16_t     _poolUsed = 0;
+  uint32_t     _overflows = 0;
+};
+
+TFT_eSprite  g_frame = TFT_eSprite(&tft);   // tam kare veya serit sprite'i
+ScreenCanvas spr(&g_frame);
+
+struct SprDirtyList
+{
+  uint8_t count;
+  SprRect r[SPR_DIRTY_MAX];
+};
+
+SprDirtyList g_sprDirty;
+
+// Ust bar kendi kucuk sprite'inda: ekran cizimleri onu tam cizer, saniyelik
+// guncelleme sadece degisen saat/tarih karakterlerini yeniden cizip o
+// araligi gonderir. sprTop ayrilamazsa bar eskisi gibi ana sprite'a cizilir.
+TFT_eSprite  sprTop = TFT_eSprite(&tft);
+ScreenCanvas g_topCanvas(&sprTop);
+
+struct TopBarState
+{
+  bool   ownSprite;     // sprTop olusturuldu
+  bool   drawn;         // sprTop'ta gecerli bir bar var
+  bool   pushPending;   // tam bar bir sonraki sprPresent()'te gonderilir
+  bool   wifi;
+  String title;
+  String date;
+  String time;
+};
+
+TopBarState g_topBar;
+
+// DMA ile ekrana gonderim: ESP32'de SPI DMA PSRAM'den okuyamadigi icin
+// sprite'lar PSRAM'de kalir, dahili RAM'de iki serit tamponu donusumlu
+// kullanilir. Bir serit SPI'dan akarken digeri sprite'tan kopyalanir; son
+// serit sprPresent() dondukten sonra da akar, CPU loop()'a doner. Ayni
+// hattaki dokunmatik once lcdDmaWait() cagirir; RFID ayri hatta.
+#define LCD_DMA_STRIP_PX  (320 * 16)   // serit basina piksel (10 KB)
+
+#ifdef SPI_FREQUENCY
+const uint32_t LCD_SPI_HZ = SPI_FREQUENCY;
+#else
+const uint32_t LCD_SPI_HZ = 40000000;
+#endif
+
+struct LcdDma
+{
+  bool      enabled;       // initDMA + tamponlar tamam; degilse bloklayan pushSprite
+  bool      inFlight;      // startWrite acik, son serit hala gidiyor olabilir
+  uint8_t   next;          // siradaki bos tampon
+  uint16_t *buf[2];
+};
+
+// Kare sureleri: sprPresent'te gecen CPU suresi ile piksellerin hattaki
+// suresi karsilastirilir; fark loop()'a geri verilen suredir.
+struct LcdFrameStats
+{
+  uint32_t frames;
+  uint32_t pixels;
+  uint32_t presentUs;      // sprPresent / bar guncellemesi icinde gecen sure
+  uint32_t maxPresentUs;
+  uint32_t waitUs;         // baska SPI kullanicisinin DMA'nin bitmesini beklemesi
+};
+
+LcdDma        g_lcdDma;
+LcdFrameStats g_lcdStats;
+
+void lcdDmaWait();
+
 XPT2046_Touchscreen ts(TOUCH_CS, TOUCH_IRQ);
 
 MFRC522 mfrc522(RFID_SS, RFID_RST);
 
-// RS485 UART
-HardwareSerial RS485Serial(2);
+// Kart UID'si ikili anahtar olarak tutulur; hex sadece ekran, log ve NVS icin
+#define CARD_UID_MAX 10   // MFRC522::Uid ile ayni (4, 7 veya 10 bayt)
 
-// -----------------------------------------------------------------------------
-// SPI sahipligi: TFT/Dokunmatik vs RFID
-// -----------------------------------------------------------------------------
-enum SpiOwner {
-  SPI_OWNER_TFT,
-  SPI_OWNER_RFID
+struct CardUid
+{
+  uint8_t len;                // 0 = bos
+  uint8_t b[CARD_UID_MAX];
 };
 
-SpiOwner g_spiOwner = SPI_OWNER_TFT;
-bool g_rfidInitialized = false;
+// Kart algilama zamanlayicisi. Kart yokken PICC_IsNewCardPresent() REQA
+// cevabini MFRC522 zamanlayicisi dolana kadar (~25 ms) bekler; loop()
+// hizinda cagrilinca hem CPU hem SPI bu bekleyiste gider. Bu yuzden REQA
+// sadece baslatilir (5 yazmac yazimi) ve cevap beklenmez, sorgu da
+// RFID_POLL_MS'de bire indirilir:
+// - IRQ pini bagliysa cevap gelince kesme bayragi kalkar. Algilama
+//   gecikmesi en fazla RFID_POLL_MS + ~5 ms (anti-carpisma/secim).
+// - Bagli degilse (RFID_IRQ = -1) bir sonraki sorguda ComIrqReg'deki
+//   RxIRq okunur: cevap geldiyse UID okunur, gelmediyse REQA yenilenir.
+//   Algilama gecikmesi en fazla 2 x RFID_POLL_MS + ~5 ms.
+// Kart yokken her iki modda sorgu basina bekleme 1 yazmac okuma + 5 yazmac
+// yazimi, SPI'da birkac on us; 'r' komutu gercek ortalamayi verir.
+const uint16_t RFID_POLL_MS = 80;   // 12.5 Hz
+
+struct RfidPoller
+{
+  uint32_t      lastPollMs;
+  bool          irqMode;
+  volatile bool irqFired;
+  bool          kicked;       // REQA gonderildi, cevabi henuz kontrol edilmedi
+  uint32_t      polls;
+  uint32_t      cards;
+  uint32_t      busyUs;       // sorgularda gecen toplam sure
+};
 
-// SPI'yi TFT + dokunmatik tarafına ayarla
-void spiUseTFT() {
-  if (g_spiOwner == SPI_OWNER_TFT) return;
-  SPI.end();
-  SPI.begin(TFT_SCLK, TFT_MISO, TFT_MOSI, TFT_CS);
-  g_spiOwner = SPI_OWNER_TFT;
-}
+RfidPoller g_rfid;
 
-// SPI'yi RFID pinlerine ayarla
-void spiUseRFID() {
-  if (g_spiOwner == SPI_OWNER_RFID) return;
-  SPI.end();
-  SPI.begin(RFID_SCK, RFID_MISO, RFID_MOSI, RFID_SS);
-  g_spiOwner = SPI_OWNER_RFID;
+// RS485 UART: IDF surucusu, RS485 half-duplex modunda
+const uart_port_t RS485_UART          = UART_NUM_2;
+const int         RS485_RX_BUF_SIZE   = 512;
+const int         RS485_EVT_QUEUE_LEN = 16;
+const uint8_t     RS485_RX_TOUT_SYMS  = 3;   // bu kadar karakter sessizlikte RX olayi
 
-  if (!g_rfidInitialized) {
-    mfrc522.PCD_Init();
-    Serial.println(F("MFRC522 baslatildi (ayri SPI pinleri ile)."));
-    mfrc522.PCD_DumpVersionToSerial();
-    g_rfidInitialized = true;
-  }
-}
+QueueHandle_t g_rs485UartQueue    = nullptr;
+uint32_t      g_rs485RxOverflows  = 0;
+uint32_t      g_rs485RxLineErrors = 0;
+
+#ifndef USE_HSPI_PORT
+#error "TFT_eSPI User_Setup.h icinde USE_HSPI_PORT tanimlanmali: VSPI (global SPI) RFID'ye ayrildi"
+#endif
 
 // -----------------------------------------------------------------------------
 // Ekran State Machine
@@ -145,9 +321,18 @@ ScreenState currentScreen = SCR_SETUP_MENU;
 // -----------------------------------------------------------------------------
 // RS485 / Modbus / Normal Mod Durumlari
 // -----------------------------------------------------------------------------
-const uint8_t  MB_SLAVE_ADDR          = 1;
 const uint8_t  MB_FC_READ_HOLDING     = 0x03;
 const uint8_t  MB_FC_WRITE_SINGLE_REG = 0x06;
+const uint8_t  MB_FC_READ_WRITE_MULTI = 0x17;
+const uint8_t  MB_EXCEPTION_BIT       = 0x80;
+
+// Modbus exception kodlari
+const uint8_t  MB_EX_ILLEGAL_FUNCTION  = 0x01;
+const uint8_t  MB_EX_ILLEGAL_ADDRESS   = 0x02;
+const uint8_t  MB_EX_ILLEGAL_VALUE     = 0x03;
+const uint8_t  MB_EX_DEVICE_FAILURE    = 0x04;
+const uint8_t  MB_EX_ACKNOWLEDGE       = 0x05;
+const uint8_t  MB_EX_DEVICE_BUSY       = 0x06;
 
 const uint16_t REG_CONTROL_CMD   = 0;
 const uint16_t REG_STATUS_FLAGS  = 1;
@@ -170,18 +355,516 @@ struct MeterData
   uint16_t flowRateClm;
 };
 
-MeterData    g_lastMeter;
-bool         g_sessionActive           = false;
-String       g_activeDriverUid;
+// Sayac register haritasi: her MeterData alani icin adres, genislik, kelime
+// sirasi ve olcek. Baska marka sayac icin yeni bir harita tanimlamak yeter;
+// cozucu (meterDecodeMap<>) haritadan derleme zamaninda uretilir.
+enum MeterField
+{
+  MF_STATUS = 0,
+  MF_SESSION_VOL,
+  MF_TOTAL_VOL,
+  MF_FLOW_RATE,
+  MF_COUNT
+};
+
+#define MF_BIT(f) ((uint16_t)(1u << (f)))
+
+// Ekranlarin ihtiyac duydugu alanlar (okuma plani bunlardan cikar). Toplam
+// sayac oturum hacmi ile debi arasinda: ayni okumaya sigar, ek cerceve yok.
+const uint16_t METER_FIELDS_FUELING = MF_BIT(MF_STATUS) | MF_BIT(MF_SESSION_VOL) |
+                                      MF_BIT(MF_TOTAL_VOL) | MF_BIT(MF_FLOW_RATE);
+const uint16_t METER_FIELDS_PROBE   = MF_BIT(MF_STATUS);
+
+enum RegWordOrder
+{
+  REG_WORDS_HI_FIRST = 0,   // 32 bit: once yuksek kelime (big-endian)
+  REG_WORDS_LO_FIRST        // 32 bit: once dusuk kelime (word-swapped)
+};
+
+struct MeterRegDesc
+{
+  uint16_t addr;
+  uint8_t  words;      // 0 = sayacta yok, 1 = 16 bit, 2 = 32 bit
+  uint8_t  order;      // RegWordOrder
+  uint16_t scaleMul;   // MeterData birimi (cl, cl/dk) = ham * scaleMul / scaleDiv
+  uint16_t scaleDiv;
+};
+
+#define METER_REG_IMAGE 16   // m.regs: haritanin base'inden itibaren register goruntusu
+
+struct MeterRegMap
+{
+  uint16_t     base;         // m.regs[0]'in register adresi
+  uint16_t     controlAddr;  // dolum baslatma komut register'i
+  uint16_t     startCmd;     // baslatma icin yazilan deger
+  MeterRegDesc f[MF_COUNT];
+};
+
+// Alan haritanin register goruntusune sigiyor mu (derleme zamani kontrolu)
+constexpr bool meterMapFits(const MeterRegMap &map, uint8_t i)
+{
+  return i >= MF_COUNT ||
+         ((map.f[i].words == 0 ||
+           (map.f[i].addr >= map.base &&
+            map.f[i].addr + map.f[i].words <= map.base + METER_REG_IMAGE)) &&
+          map.f[i].scaleDiv != 0 &&
+          meterMapFits(map, i + 1));
+}
+
+// Ham deger: ofset, genislik ve kelime sirasi sabit oldugu icin
+// her alan tek bir yukleme/kaydirmaya iner.
+template <const MeterRegMap &Map, uint8_t F>
+inline uint32_t meterFieldRaw(const uint16_t *regs)
+{
+  return Map.f[F].words == 0 ? 0
+       : Map.f[F].words == 1 ? regs[Map.f[F].addr - Map.base]
+       : Map.f[F].order == REG_WORDS_HI_FIRST
+           ? ((uint32_t)regs[Map.f[F].addr - Map.base] << 16) | regs[Map.f[F].addr - Map.base + 1]
+           : ((uint32_t)regs[Map.f[F].addr - Map.base + 1] << 16) | regs[Map.f[F].addr - Map.base];
+}
+
+template <const MeterRegMap &Map, uint8_t F>
+inline uint32_t meterFieldValue(const uint16_t *regs)
+{
+  return Map.f[F].scaleMul == Map.f[F].scaleDiv
+           ? meterFieldRaw<Map, F>(regs)
+           : (uint32_t)((uint64_t)meterFieldRaw<Map, F>(regs) * Map.f[F].scaleMul / Map.f[F].scaleDiv);
+}
+
+// Sadece 'fields' maskesindeki alanlar guncellenir, digerleri eski degerinde kalir
+template <const MeterRegMap &Map>
+void meterDecodeMap(const uint16_t *regs, uint16_t fields, MeterData &out)
+{
+  static_assert(meterMapFits(Map, 0), "register haritasi METER_REG_IMAGE'a sigmiyor");
+
+  if (fields & MF_BIT(MF_STATUS))      out.statusFlags  = (uint16_t)meterFieldValue<Map, MF_STATUS>(regs);
+  if (fields & MF_BIT(MF_SESSION_VOL)) out.sessionVolCl = meterFieldValue<Map, MF_SESSION_VOL>(regs);
+  if (fields & MF_BIT(MF_TOTAL_VOL))   out.totalVolCl   = meterFieldValue<Map, MF_TOTAL_VOL>(regs);
+  if (fields & MF_BIT(MF_FLOW_RATE))   out.flowRateClm  = (uint16_t)meterFieldValue<Map, MF_FLOW_RATE>(regs);
+}
+
+typedef void (*MeterDecodeFn)(const uint16_t *regs, uint16_t fields, MeterData &out);
+
+struct MeterModel
+{
+  const char        *name;
+  const MeterRegMap *map;
+  MeterDecodeFn      decode;
+};
+
+// Standart sayac: 32 bit hacimler yuksek kelime once, birimler zaten cl / cl/dk
+constexpr MeterRegMap METER_MAP_STD = {
+  REG_STATUS_FLAGS, REG_CONTROL_CMD, 1,
+  {
+    { REG_STATUS_FLAGS,  1, REG_WORDS_HI_FIRST, 1, 1 },   // MF_STATUS
+    { REG_SESSION_VOL_H, 2, REG_WORDS_HI_FIRST, 1, 1 },   // MF_SESSION_VOL
+    { REG_TOTAL_VOL_H,   2, REG_WORDS_HI_FIRST, 1, 1 },   // MF_TOTAL_VOL
+    { REG_FLOW_RATE,     1, REG_WORDS_HI_FIRST, 1, 1 },   // MF_FLOW_RATE
+  }
+};
+
+const MeterModel METER_MODEL_STD = { "std", &METER_MAP_STD, meterDecodeMap<METER_MAP_STD> };
+
+// Okuma plani: istenen alanlar en az sayida bitisik FC03 okumasina bolunur.
+// Iki alan arasindaki bosluk MB_PLAN_MERGE_GAP_REGS'ten kucukse tek okumada
+// birlestirilir: fazladan register 2 bayt, yeni bir islem ise istek + cevap
+// basligi + 2 x t3.5 + slave turnaround (~20 karakterden fazla) demektir.
+const uint8_t MB_PLAN_MERGE_GAP_REGS = 8;
+
+struct MeterReadSpan
+{
+  uint16_t start;
+  uint8_t  qty;
+  uint16_t fields;     // bu okumayla tamamlanan alanlar
+};
+
+struct MeterReadPlan
+{
+  uint8_t       count;
+  uint16_t      fields;
+  MeterReadSpan reads[MF_COUNT];
+};
+
+// Modbus master: bloklamayan islem motoru (loop() icinden mbPoll ile ilerler)
+#define MB_MAX_READ_REGS   32
+#define MB_MAX_WRITE_REGS  8
+#define MB_TX_BUF_SIZE     (11 + 2 * MB_MAX_WRITE_REGS + 2)   // FC17 en uzun istek
+
+// Zamanlama baud'dan turetilir (rs485SetBaud): 8N1 = karakter basina 10 bit.
+// Cevap suresi = slave turnaround payi + cevap cercevesi + UART RX timeout payi + t3.5
+const uint32_t RS485_DEFAULT_BAUD       = 19200;
+const uint32_t RS485_PROBE_BAUDS[]      = { 115200, 57600, 38400, 19200 };
+const bool     RS485_AUTO_BAUD_PROBE    = true;   // acilista en yuksek calisan hizi ara
+const uint32_t MB_BITS_PER_CHAR         = 10;
+const uint32_t MB_TURNAROUND_DEFAULT_US = 10000;  // slave'in cevabi hazirlama payi
+const uint32_t MB_RX_SLACK_CHARS        = 12;     // UART RX timeout ile byte'larin gec gelmesi
+
+uint32_t g_rs485Baud      = RS485_DEFAULT_BAUD;
+uint32_t g_mbCharUs       = 0;   // bir karakterin hattaki suresi
+uint32_t g_mbT35Us        = 0;   // 3.5 karakter sessizlik: cerceve sonu / cerceveler arasi
+uint32_t g_mbTurnaroundUs = MB_TURNAROUND_DEFAULT_US;
+
+enum MbState
+{
+  MB_STATE_IDLE = 0,
+  MB_STATE_WAIT_RESP,
+  MB_STATE_RESYNC        // bozuk/eksik cerceve sonrasi: hat t3.5 sessiz kalana kadar at
+};
+
+enum MbResult
+{
+  MB_RESULT_NONE = 0,
+  MB_RESULT_OK,
+  MB_RESULT_TIMEOUT,
+  MB_RESULT_CRC,
+  MB_RESULT_BAD_FRAME,
+  MB_RESULT_EXCEPTION
+};
+
+typedef void (*MbDoneCallback)(MbResult result, void *ctx);
+
+// Parser'in reddetme nedeni; parser log basmaz, mbPoll() bununla loglar
+enum MbRxError
+{
+  MB_RXERR_NONE = 0,
+  MB_RXERR_ADDR,          // slave adresi farkli
+  MB_RXERR_FC,            // fn kodu farkli (exception degil)
+  MB_RXERR_BYTE_COUNT,    // byteCount != readQty * 2
+  MB_RXERR_CRC,
+  MB_RXERR_ECHO,          // FC06 echo istegin aynisi degil
+  MB_RXERR_OVERRUN        // tamamlanmis cerceveye fazladan bayt
+};
+
+struct MbTransaction
+{
+  MbState         state;
+  MbResult        result;
+  uint8_t         slaveAddr;
+  uint8_t         fc;
+  uint16_t        readQty;      // FC03/FC17: okunan register adedi
+  uint16_t       *outRegs;      // okunan register'lar bayt geldikce buraya yazilir
+  uint8_t         txFrame[MB_TX_BUF_SIZE];
+  uint8_t         txLen;
+  uint16_t        rxLen;
+  uint16_t        rxExpected;
+  uint16_t        rxCrc;        // alinan baytlar uzerinden surekli CRC
+  uint8_t         rxHiByte;     // register'in ilk (yuksek) bayti
+  bool            rxEchoErr;    // FC06: cevap istegin aynisi degil
+  bool            rxException;  // fn | 0x80 geldi, 5 baytlik exception cercevesi
+  uint8_t         exceptionCode;
+  MbRxError       rxError;
+  uint8_t         rxBadByte;    // rxError'a yol acan bayt
+  uint32_t        lastRxUs;     // son bayt(lar)in okundugu an
+  uint32_t        submitUs;
+  uint32_t        respStartUs;  // istek hatta bittikten sonra
+  uint32_t        respTimeoutUs;
+  MbDoneCallback  onDone;
+  void           *ctx;
+};
+
+MbTransaction g_mb;
+uint32_t      g_mbLastFrameEndUs = 0;
+uint32_t      g_mbResyncCount    = 0;
+uint32_t      g_mbDiscardedBytes = 0;
+
+// Modbus trafik kaydi: her TX/RX cercevesi us zaman damgasiyla PSRAM'deki
+// sabit boyutlu halkaya yazilir; sicak yolda maliyet bir memcpy'dir. Halka
+// doldukca en eski kayit ezilir. Seri konsoldan 'm' ile ikili aktarilir,
+// host araci bunu pcap/CSV'ye cevirir.
+//
+// Aktarim formati (little-endian):
+//   "MBCAP BEGIN\r\n"
+//   baslik : "MBC1" | u32 baud | u32 toplam kayit (ezilenler dahil)
+//   kayit  : u32 tUs | u16 durUs | u8 flags | u8 len | len bayt veri
+//   son    : flags = 0xFF olan bos kayit
+//   "MBCAP END <aktarilan> <yirtik> <crc16 hex>\n"  (crc: baslik + kayitlar)
+// tUs = ilk baytin goruldugu an, durUs = son bayta kadar gecen sure.
+// RX kaydi islemin tum baytlarini (RESYNC'te atilanlar dahil) tasir; hic
+// bayt gelmeyen timeout da bos RX kaydi olarak yazilir.
+#define MB_CAP_SLOTS     8192      // ~640 KB PSRAM, dakikalar mertebesinde gecmis
+#define MB_CAP_DATA_MAX  72
+
+const uint8_t MB_CAP_FLAG_RX     = 0x01;
+const uint8_t MB_CAP_FLAG_TRUNC  = 0x02;   // veri MB_CAP_DATA_MAX'ta kesildi
+const uint8_t MB_CAP_FLAG_RESYNC = 0x04;   // cevap sonrasi hattan bayt atildi
+const uint8_t MB_CAP_RESULT_SHIFT = 4;     // bit4-7: MbResult (RX)
+const uint8_t MB_CAP_FLAG_END    = 0xFF;
+
+struct MbCapRecord
+{
+  uint32_t tUs;
+  uint16_t durUs;
+  uint8_t  flags;
+  uint8_t  len;
+  uint8_t  data[MB_CAP_DATA_MAX];
+};
+
+const size_t MB_CAP_REC_HDR = offsetof(MbCapRecord, data);
+static_assert(MB_CAP_REC_HDR == 8, "MbCapRecord basligi aktarim formatiyla ayni olmali");
+static_assert(MB_CAP_DATA_MAX >= MB_TX_BUF_SIZE && MB_CAP_DATA_MAX >= 5 + 2 * MB_MAX_READ_REGS,
+              "normal cerceveler kayda sigmali");
+
+// Tek yazar RS485 gorevidir. Yazilan kayit halkadaki `written` sirali yuvaya
+// dogrudan doldurulur, bitince `written` arttirilir. Okuyucu (aktarim)
+// kopyaladiktan sonra `written`'a tekrar bakar; yazar o yuvaya donmusse
+// kayit yirtik sayilip atlanir (kilitsiz, yazar hic beklemez).
+struct MbCapture
+{
+  MbCapRecord          *slots;      // PSRAM; ayrilamazsa kayit kapali
+  std::atomic<uint32_t> written;
+  bool                  rxOpen;     // `written` yuvasinda RX kaydi dolduruluyor
+};
+
+MbCapture g_mbCap;
+
+// Aktarim loop()'u bekletmez: her turda seri TX tamponuna sigdigi kadar kayit
+// yazilir, gerisi sonraki turlara kalir. Halkanin kopyasi alinmaz; kayit
+// yazilirken yukaridaki yirtik kontrolu yapilir. Aktarim suresince RS485
+// gorevinin loglari susturulur, aksi halde ikili akisa karisir.
+#define MB_CAP_EXPORT_CHUNK  1024      // loop() turu basina azami bayt
+
+struct MbCapExport
+{
+  bool     active;
+  uint32_t next, end;        // siradaki / son kayit (end: baslangictaki `written`)
+  uint32_t sent, torn;
+  uint16_t crc;
+};
+
+MbCapExport   g_mbCapExport;
+volatile bool g_mbLogMuted = false;   // UI yazar, RS485 gorevi okur
+
+// Ayni RS485 hattindaki sayaclar: her tabanca/dispenser bir slave adresi + model
+struct MeterConfig
+{
+  uint8_t           slaveAddr;
+  const MeterModel *model;
+};
+
+const MeterConfig METER_CONFIG[] = {
+  { 1, &METER_MODEL_STD },
+};
+const uint8_t METER_COUNT = sizeof(METER_CONFIG) / sizeof(METER_CONFIG[0]);
+
+// Gecikme histogrami: 1 ms'lik kutular, son kutu "bu ve ustu"
+#define METER_LAT_BUCKETS 64
+// Adaptif poll araligi kademeleri: FAST / NORMAL / STEADY / NO_FLOW
+#define METER_POLL_TIERS  4
+
+struct MeterPollStats
+{
+  uint32_t polls;
+  uint32_t okCount;
+  uint32_t failCount;
+  uint32_t timeouts;
+  uint32_t crcErrors;
+  uint32_t exceptions;
+  uint32_t badFrames;
+  uint32_t retries;        // hata sonrasi yapilan tekrar denemeleri
+  uint32_t circuitOpens;   // devre kesiciye giris sayisi
+  uint32_t lastLatencyUs;
+  uint32_t maxLatencyUs;
+  uint32_t lastOkMs;
+  uint16_t latencyHist[METER_LAT_BUCKETS];
+  uint32_t tierSamples[METER_POLL_TIERS];  // ornegin sonunda secilen araliga gore
+};
+
+// Hata politikasi: CRC hatasi hat gurultusudur, hemen tekrar denenir.
+// Timeout sayac cevap vermiyor demektir, ustel geri cekilme ile beklenir.
+// Ust uste cok hata olursa devre acilir: sayac seyrek ve ucuz (tek register)
+// bir yoklama ile izlenir, ilk basarili cevapta normal poll'a donulur.
+struct MbRetryPolicy
+{
+  uint8_t  crcImmediateRetries;  // CRC hatasinda beklemeden tekrar sayisi
+  uint16_t backoffBaseMs;        // ilk timeout sonrasi bekleme
+  uint16_t backoffMaxMs;         // ustel beklemenin tavani
+  uint8_t  openAfterFailures;    // bu kadar ardisik hatada devre acilir
+  uint16_t openProbeIntervalMs;  // devre acikken yoklama araligi
+};
+
+const MbRetryPolicy MB_RETRY_POLICY = { 1, 200, 5000, 6, 10000 };
+
+// FC17 (Read/Write Multiple) destegi ilk denemede ogrenilir
+enum MeterRwSupport
+{
+  METER_RW_UNKNOWN = 0,
+  METER_RW_SUPPORTED,
+  METER_RW_UNSUPPORTED
+};
+
+const bool METER_USE_RW_MULTI = true;   // dolum baslatmayi tek cercevede dene
+
+struct Meter
+{
+  uint8_t        slaveAddr;
+  const MeterModel *model;
+  MeterReadPlan  plan;           // METER_FIELDS_FUELING icin okuma plani
+  uint8_t        planStep;       // plandaki siradaki okuma (0 = poll basi)
+  MeterRwSupport rwSupport;
+  MeterData      data;
+  uint32_t       sampleMs;       // data'nin son okumasinin tamamlandigi an
+  bool           sessionActive;
+  uint16_t       regs[METER_REG_IMAGE]; // register goruntusu, regs[i] = adres base + i
+  uint32_t       lastPollMs;
+  uint32_t       sessionStartMs;
+  uint16_t       pollIntervalMs; // adaptif olarak secilen poll araligi (metrik)
+  uint8_t        steadyCount;    // debi degismeden gecen ardisik ornek
+  uint8_t        failStreak;     // ardisik basarisiz islem
+  uint8_t        crcRetries;     // bu hata serisinde yapilan hizli tekrar
+  bool           circuitOpen;    // devre kesici acik: sadece seyrek yoklama
+  uint16_t       retryDelayMs;   // hata sonrasi bir sonraki denemeye kadar
+  bool           publishPending; // son ornek kuyruga sigmadi, tekrar yayinlanacak
+  MeterPollStats stats;
+};
+
+// g_meters ve Modbus motoru sadece RS485 gorevine aittir; UI bunlara
+// dokunmaz, sayac durumunu asagidaki olay kuyrugundan okur.
+Meter   g_meters[METER_COUNT];
+uint8_t g_busNextMeter = 0;     // round-robin imleci
+
+// RS485 gorevi: Modbus I/O core 0'da, UI (loop) core 1'de calisir.
+// Boylece pushSprite suresi poll zamanlamasini, poll da ekrani bozmaz.
+const BaseType_t  RS485_TASK_CORE  = 0;
+const UBaseType_t RS485_TASK_PRIO  = 3;
+const uint32_t    RS485_TASK_STACK = 4096;
+
+TaskHandle_t g_rs485Task = nullptr;
+
+// RS485 gorevi -> UI olaylari
+enum MeterEventKind
+{
+  METER_EVT_SAMPLE = 0,    // yeni okuma
+  METER_EVT_START_OK,      // dolum baslatildi (data = ilk durum)
+  METER_EVT_START_FAIL     // dolum baslatilamadi
+};
+
+struct MeterEvent
+{
+  uint8_t   kind;
+  uint8_t   meterIdx;
+  bool      sessionActive;
+  MeterData data;
+  uint32_t  sampleMs;      // orneklemenin RS485 gorevindeki zamani
+};
+
+// Tek ureticili / tek tuketicili halka: uretici sadece head'i, tuketici
+// sadece tail'i yazar, kilit ve bekleme yoktur. Doluysa push basarisiz olur;
+// uretici durum degisikligini kaybetmemek icin daha sonra tekrar dener.
+#define METER_EVT_RING_SIZE 16   // 2'nin kuvveti olmali
+
+struct MeterEventRing
+{
+  MeterEvent            buf[METER_EVT_RING_SIZE];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  uint32_t              drops;
+};
+
+MeterEventRing g_meterEvents;
+
+// UI -> RS485 gorevi komutlari (seyrek; FreeRTOS kuyrugu yeterli)
+enum MeterCmdKind
+{
+  METER_CMD_START_SESSION = 0
+};
+
+struct MeterCmd
+{
+  uint8_t kind;
+  uint8_t meterIdx;
+};
+
+QueueHandle_t g_meterCmdQueue = nullptr;
+
+// UI tarafi: olaylardan beslenen kopya
+uint8_t   g_activeMeter = 0;              // ekranda gosterilen dolumun sayaci
+bool      g_uiMeterActive[METER_COUNT];
+MeterData g_uiMeterData[METER_COUNT];
+bool      g_uiMeterDirty[METER_COUNT];
+bool      g_uiStartPending = false;       // baslatma komutu gonderildi, sonuc bekleniyor
+
+// Dolum baslatma: CONTROL_CMD yazimi + ilk durum okumasi, bus bosaldikca ilerler
+enum SessionStartPhase
+{
+  SSP_NONE = 0,
+  SSP_QUEUED,
+  SSP_RW_MULTI,        // FC17: komut + durum tek cercevede
+  SSP_CMD_QUEUED,      // iki adimli yol: FC06 + FC03
+  SSP_WRITE_CMD,
+  SSP_STATUS_QUEUED,
+  SSP_READ_STATUS,
+  SSP_VERIFY_QUEUED,   // FC17 cevapsiz/bozuk: komut islendi mi, once durum okunur
+  SSP_VERIFY_STATUS
+};
+
+SessionStartPhase g_sessionStartPhase = SSP_NONE;
+uint8_t           g_sessionStartMeter = 0;
+bool              g_sessionStartResultPending = false;  // sonuc olayi kuyruga sigmadi
+MeterEvent        g_sessionStartResult;
+
+CardUid      g_activeDriverUid;
 String       g_activeDriverPlate;
 float        g_lastSessionLiters       = 0.0f;
-unsigned long g_lastMeterPollMs        = 0;
-const unsigned long METER_POLL_INTERVAL_MS = 300;
+
+// Adaptif poll araliklari (ms)
+const uint16_t METER_POLL_FAST_MS     = 100;  // baslangic, ani debi degisimi
+const uint16_t METER_POLL_NORMAL_MS   = 300;  // debi oturana kadar
+const uint16_t METER_POLL_STEADY_MS   = 600;  // sabit debi
+const uint16_t METER_POLL_NO_FLOW_MS  = 1000; // oturum acik ama akis yok
+const uint32_t METER_START_FAST_MS    = 2000; // baslangictan sonra hizli poll suresi
+const uint16_t METER_FLOW_DELTA_CLM   = 300;  // bundan buyuk debi farki "ani" sayilir
+const uint8_t  METER_STEADY_SAMPLES   = 3;    // sabit debi icin ardisik ornek sayisi
 
 // Dolum bitti ekrani zamanlayici
 unsigned long g_fuelSummaryStartMs     = 0;
 const unsigned long FUEL_SUMMARY_DISPLAY_MS = 3000;
 
+// Dolum ekrani buyuk rakam gostergeleri (7 segment). Deger santilitre /
+// santilitre-dk tamsayi olarak verilir, 2 ondalik sabit; float/snprintf
+// yok. Her hane son cizilen segment maskesini tutar, sadece degisen hane
+// hucresi silinip yeniden cizilir ve kirli isaretlenir: litre sayacinin
+// son hanesi icin guncelleme basina ~1.3 kpiksel.
+#define SEG_MAX_DIGITS 8
+
+struct SegDisplay
+{
+  int16_t  x, y;                   // sol ust
+  uint8_t  w, h, t;                // hane genisligi, yuksekligi, segment kalinligi
+  uint8_t  gap;                    // haneler arasi bosluk
+  uint8_t  digits;                 // ondaliklar dahil hane sayisi
+  uint8_t  decimals;
+  uint16_t fg, bg;
+  bool     valid;                  // ekrandaki haneler `shown` ile ayni
+  uint8_t  shown[SEG_MAX_DIGITS];  // hane basina segment maskesi (gfedcba)
+};
+
+SegDisplay g_segLiters = {  46,  62, 28, 48, 6, 6, 6, 2, TFT_WHITE, TFT_BLACK, false, {0} };
+SegDisplay g_segFlow   = {  86, 126, 14, 24, 3, 4, 5, 2, TFT_CYAN,  TFT_BLACK, false, {0} };
+
+// Dolum ekrani litre sayaci tahmincisi: poll'lar arasinda gosterilen
+// degeri bildirilen debi ile son olcume dogru ilerletir. Garantiler:
+//  - gosterilen deger son olculen degeri hic gecmez; akis aniden kesilse
+//    ya da yavaslasa da ekran oturum sonu degerinin ustune cikmaz,
+//  - oturum icinde hic azalmaz (tek istisna sayacin kendisinin geri
+//    gitmesi, orn. yeniden baslatma),
+//  - en fazla bir ornek geride kalir: yeni ornek geldiginde bir onceki
+//    olcumun gerisindeyse oraya atlar,
+//  - oturum sonu degeri tahminsiz, aynen cizilir.
+const uint16_t FUEL_COUNTER_FRAME_MS = 50;   // sayac cizimi en fazla 20 Hz
+
+struct FuelCounterEst
+{
+  uint32_t measCl;      // son olculen oturum hacmi
+  uint16_t flowClm;     // son ornegin debisi (akis yoksa 0)
+  uint32_t shownCl;     // ekrandaki tahmin
+  uint32_t shownMs;     // shownCl'in hesaplandigi an
+  uint32_t fracClMs;    // cl*ms cinsinden artik (yuvarlama kaybi olmasin)
+  uint32_t drawnCl;     // ekrana en son cizilen deger
+  uint32_t drawnMs;
+};
+
+FuelCounterEst g_fuelEst;
+
 // -----------------------------------------------------------------------------
 // Ana Menü Butonları
 // -----------------------------------------------------------------------------
@@ -227,8 +910,6 @@ const int DRIVER_LIST_ROW_H = 18;
 // -----------------------------------------------------------------------------
 // Konfig Yapısı (NVS)
 // -----------------------------------------------------------------------------
-#define MAX_DRIVERS  20
-
 struct WifiConfig
 {
   String ssid;
@@ -245,20 +926,8 @@ struct PhoneApiConfig
 
 struct AdminCardConfig
 {
-  String uidHex;
-  bool   isSet;
-};
-
-struct DriverCard
-{
-  String uidHex;
-  String plate;
-};
-
-struct DriverCardList
-{
-  DriverCard items[MAX_DRIVERS];
-  uint8_t    count;
+  CardUid uid;
+  bool    isSet;
 };
 
 struct AppConfig
@@ -266,12 +935,133 @@ struct AppConfig
   WifiConfig      wifi;
   PhoneApiConfig  phoneApi;
   AdminCardConfig adminCard;
-  DriverCardList  drivers;
 };
 
 Preferences prefs;
 AppConfig   config;
 
+// -----------------------------------------------------------------------------
+// Sofor kart deposu (PSRAM + flash sayfalari)
+// -----------------------------------------------------------------------------
+// Kayitlar sabit 24 bayt: ikili UID + sabit genislikte plaka, heap String
+// yok. Tum tablo PSRAM'de durur; kalici kopya ayri bir flash bolumunde
+// 4 KB'lik sayfalardadir (sayfa = 16 bayt baslik + 170 kayit). Ekleme /
+// plaka degisikligi sadece ilgili sayfayi yeniden yazar, NVS'ye kart
+// basina anahtar yazilmaz. Bolum: "drivers" etiketli data bolumu; sketch
+// klasorundeki partitions.csv bunu varsayilan semadaki SPIFFS'in yerine
+// (ayni adres, 1.375 MB) koyar. Bolum yoksa depo kalici olmaz; ozel tablo
+// kullanilamayan kartlarda -DDRIVER_STORE_SPIFFS_FALLBACK ile ilk SPIFFS
+// bolumu alinir (icerigi silinir, acilista uyari basilir).
+//
+// Guc kesintisi: sayfa yerinde yeniden yazilmaz. Her yazim bos ya da eski
+// kopya tasiyan bir sektore gider: sektor silinir, once kayitlar, en son
+// baslik (artan seq + sayfa no + CRC) yazilir. Basligi tamamlanmamis sektor
+// yuklemede gecersizdir ve sayfanin onceki kopyasi kullanilir; guncel kopya
+// yenisi yazilana kadar silinmez. Yukleme tum sektorleri tarar, bos/bozuk
+// olanlari atlar, her sayfanin en yuksek seq'li gecerli kopyasini alir. Bos
+// sektorler sirayla kullanilir (asinma dengelemesi); en az bir yedek sektor
+// ayrilir. -DDRIVER_STORE_SELFTEST kesinti senaryolarini RAM'de dener.
+//
+// Arama: acik adresli hash indeksi (lineer deneme), slot = kayit no
+// (uint16), slot sayisi 2'nin kuvveti ve >= 2 x kapasite: doluluk %50'yi
+// gecmez, kart basina ortalama ~1.5 deneme, tablo buyudukce sabit kalir.
+// Silme yok, mezar tasi gerekmez; yuklemede bastan kurulur.
+//
+// Ayak izi (PSRAM, kapasiteye gore sabit ayrilir; dahili RAM: sayfa/sektor
+// tablolari, 1.375 MB'lik "drivers" bolumunde 352 sektor icin ~1.3 KB):
+//    kart   kayitlar    indeks               flash (+1 yedek)
+//    1 000    23.4 KB     4 KB (2048 slot)      28 KB (6 sayfa)
+//   10 000   234.4 KB    64 KB (32768 slot)    240 KB (59 sayfa)
+//   50 000  1171.9 KB   256 KB (131072 slot)  1184 KB (295 sayfa)
+//
+// Arama basina deneme (-DDRIVER_STORE_BENCH'in sentetik UID'leriyle olculdu,
+// platformdan bagimsiz; isabet: depodaki tum kartlar, iskalama: 20 000
+// depoda olmayan UID):
+//    kart     isabet ort / en kotu    iskalama ort / en kotu
+//    1 000        1.47 / 10               2.32 / 14
+//   10 000        1.22 / 11               1.53 / 15
+//   50 000        1.31 / 13               1.82 / 21
+//
+// Acilista yukleme suresi (hesaplanan; 240 MHz, QIO 80 MHz flash):
+//    kart    baslik tarama   sayfa okuma   CRC      indeks   toplam
+//    1 000        ~5 ms          ~2 ms      ~1 ms    ~1 ms    ~9 ms
+//   10 000        ~5 ms         ~18 ms     ~10 ms   ~10 ms   ~43 ms
+//   50 000        ~5 ms         ~89 ms     ~50 ms   ~50 ms  ~194 ms
+// Birim maliyetler: baslik tarama sektor basina ~15 us (352 x 16 B okuma,
+// kart sayisindan bagimsiz); sayfa okuma ~0.3 ms/sayfa (4 KB flash -> RAM,
+// veri yolu 0.1 ms + cagri yuku, PSRAM'e kopya); CRC ~0.17 ms/sayfa (tablolu
+// CRC bayt basina ~10 cevrim, bench'in host olcumu da ayni); indeks ~1 us/kart
+// (PSRAM'deki indekse rastgele erisim). DIO / 40 MHz flash'ta sayfa okuma ~4
+// kat uzar. Kartta gercek degerler: acilistaki "Sofor deposu: ... ms'de
+// yuklendi" satiri ve -DDRIVER_STORE_BENCH ciktisi (parca parca, us).
+#define DRIVER_PLATE_LEN   12      // NUL dahil: en fazla 11 karakter ("34 ABC 1234")
+#define DRIVER_PAGE_SIZE   4096    // flash sektoru
+#define DRIVER_PAGE_RECS   170     // (4096 - 16) / 24
+
+const uint32_t DRIVER_CAPACITY          = 50000;   // PSRAM varken
+const uint32_t DRIVER_CAPACITY_NO_PSRAM = 256;     // dahili RAM'de (~7 KB)
+const uint32_t DRIVER_PAGE_MAGIC        = 0x32505244;   // "DRP2"
+const uint16_t DRIVER_INDEX_EMPTY       = 0xFFFF;
+const uint16_t DRIVER_SECTOR_NONE       = 0xFFFF;
+const uint32_t DRIVER_LEGACY_NVS_MAX    = 20;      // eski surum: NVS'de en fazla bu kadar kart
+
+struct DriverRecord
+{
+  CardUid uid;                      // uid.len == 0: bos kayit (bozuk sayfadan)
+  char    plate[DRIVER_PLATE_LEN];
+  uint8_t reserved;
+};
+
+// Kayitlardan sonra yazilir: tamamlanmis baslik = tamamlanmis sayfa
+struct DriverPageHeader
+{
+  uint32_t magic;
+  uint32_t seq;                     // yazim sirasi; ayni sayfanin en buyugu guncel
+  uint16_t page;                    // mantiksal sayfa no (kayit no / 170)
+  uint16_t count;                   // sayfadaki kayit sayisi
+  uint16_t crc;                     // seq + page + count + kayitlar (modbusCRC16)
+  uint16_t reserved;
+};
+
+static_assert(sizeof(DriverRecord) == 24, "DriverRecord flash formatiyla ayni olmali");
+static_assert(sizeof(DriverPageHeader) == 16, "DriverPageHeader flash formatiyla ayni olmali");
+static_assert(sizeof(DriverPageHeader) + DRIVER_PAGE_RECS * sizeof(DriverRecord) <= DRIVER_PAGE_SIZE,
+              "sofor sayfasi sektore sigmiyor");
+static_assert(DRIVER_CAPACITY < DRIVER_INDEX_EMPTY, "indeks slotu uint16");
+
+struct DriverStore
+{
+  DriverRecord          *recs;
+  uint16_t              *index;
+  uint32_t               capacity;
+  uint32_t               indexMask;     // slot sayisi - 1
+  uint32_t               count;         // kullanilan kayit (bos kayitlar dahil)
+  uint32_t               live;          // gecerli kart sayisi
+  const esp_partition_t *part;          // nullptr: kalici degil
+  uint16_t              *pageSector;    // mantiksal sayfa -> sektor (NONE: yazilmamis)
+  uint16_t              *sectorPage;    // sektor -> mantiksal sayfa (NONE: bos/eski kopya)
+  uint32_t               sectors;       // bolumde kullanilan sektor sayisi
+  uint32_t               seq;           // son yazilan sayfanin seq'i
+  uint32_t               nextSector;    // bos sektor aramasi buradan baslar
+  uint32_t               loadUs;
+};
+
+DriverStore g_drivers;
+
+#ifdef DRIVER_STORE_SELFTEST
+// Self-test icin RAM'de sahte bolum: NOR flash gibi yazim sadece 1 -> 0
+// yapar. opsLeft >= 0 ise o kadar yazma/silme sonra "enerji kesilir":
+// o islem yarim kalir, sonrakiler hata doner.
+struct DriverFlashSim
+{
+  uint8_t *mem;
+  int32_t  opsLeft;
+};
+
+esp_partition_t g_driverSimPart;
+DriverFlashSim  g_driverSim;
+#endif
+
 // -----------------------------------------------------------------------------
 // Klavye Yapısı
 // -----------------------------------------------------------------------------
@@ -360,7 +1150,7 @@ String apiKeyEditBuffer;
 // RFID ile ilgili degiskenler (Admin + Sofor)
 // -----------------------------------------------------------------------------
 String adminLastUid;
-String driverCurrentUid;
+CardUid driverCurrentUid;
 String driverPlateBuffer;
 String driverScreenInfo;
 
@@ -398,18 +1188,71 @@ void saveConfigToNVS();
 
 void configSetWifi(const String &ssid, const String &password, bool save = true);
 void configSetPhoneApi(const String &phone, const String &apiKey, bool save = true);
-void configSetAdminCard(const String &uidHex, bool save = true);
-bool configAddOrUpdateDriver(const String &uidHex, const String &plate, bool save = true);
+void configSetAdminCard(const CardUid &uid, bool save = true);
+bool configAddOrUpdateDriver(const CardUid &uid, const String &plate, bool save = true);
+
+uint32_t cardUidHash(const CardUid &u);
+bool cardUidEqual(const CardUid &a, const CardUid &b);
+bool cardUidFromHex(const String &hex, CardUid &out);
+void cardUidFormat(const CardUid &u, char *out, size_t outLen);
+String cardUidToHex(const CardUid &u);
+
+// Sofor kart deposu
+bool driverStoreAlloc(DriverStore &st, uint32_t capacity);
+void driverStoreFree(DriverStore &st);
+void driverStoreBegin();
+bool driverStoreAttach(DriverStore &st, const esp_partition_t *part);
+void driverStoreLoad(DriverStore &st);
+uint16_t driverPageCrc(const DriverPageHeader &h, const DriverRecord *recs);
+uint32_t driverStoreFreeSector(const DriverStore &st);
+bool driverStoreWritePage(DriverStore &st, uint32_t page);
+bool driverStoreSaveAll(DriverStore &st);
+bool driverStorePut(DriverStore &st, const CardUid &uid, const char *plate, bool save);
+esp_err_t driverFlashRead(const DriverStore &st, size_t off, void *dst, size_t len);
+esp_err_t driverFlashWrite(const DriverStore &st, size_t off, const void *src, size_t len);
+esp_err_t driverFlashErase(const DriverStore &st, size_t off);
+void driverStoreIndexInsert(DriverStore &st, uint32_t recIdx);
+void driverStoreIndexRebuild(DriverStore &st);
+int32_t driverStoreFind(const DriverStore &st, const CardUid &uid);
+void driverStoreErase();
+#ifdef DRIVER_STORE_BENCH
+uint32_t driverStoreProbes(const DriverStore &st, const CardUid &uid);
+void driverStoreBenchmark();
+#endif
+#ifdef DRIVER_STORE_SELFTEST
+void driverSelfTestCard(uint32_t i, uint8_t ver, CardUid &uid, char *plate);
+bool driverSelfTestHas(const DriverStore &st, uint32_t i, uint8_t ver);
+bool driverSelfTestVerify(const DriverStore &st, const uint8_t *ver, uint32_t cards,
+                          int32_t inflight, uint8_t inflightVer);
+bool driverSelfTestOpen(DriverStore &st);
+void driverStoreSelfTest();
+#endif
 
 bool isConfigOkForButton(ButtonId id);
 void drawStatusForButton(ButtonId id, bool ok, uint16_t fillColor);
 
+// Ekran: kirli bolge takibi
+void sprMarkDirty(int16_t x, int16_t y, int16_t w, int16_t h);
+void sprClear(uint16_t color);
+void sprPresent();
+bool sprRectsTouch(const SprRect &a, const SprRect &b);
+SprRect sprRectUnion(const SprRect &a, const SprRect &b);
+int32_t sprRectArea(const SprRect &a);
+void lcdInitDma();
+void lcdPushRect(TFT_eSprite &src, int16_t sx, int16_t sy, int16_t w, int16_t h, int16_t dx, int16_t dy);
+void lcdPrintFrameStats();
+bool dlInside(const SprRect &a, const SprRect &outer);
+SprRect dlBox(int32_t x, int32_t y, int32_t w, int32_t h);
+DlOp dlShape(DlOpKind kind, int32_t x, int32_t y, int32_t w, int32_t h, int32_t r, uint32_t color);
+
 // Top bar / WiFi / Zaman
 const char* getScreenTitle(ScreenState s);
-void drawWifiIcon(int16_t x, int16_t y, bool connected);
+ScreenCanvas &topBarCanvas();
+void drawWifiIcon(ScreenCanvas &dst, int16_t x, int16_t y, bool connected);
 String getCurrentTimeString();
 String getCurrentDateString();
 void drawTopBar(const char* title);
+bool topBarUpdateText(String &shown, const String &now, int16_t right, int16_t top);
 void updateTopBarForCurrentScreen();
 void handleWifiAndTime();
 bool wifiAttemptConnectBlocking(const String &ssid, const String &password);
@@ -456,7 +1299,10 @@ void drawPhoneApiScreen();
 void handleTouchOnPhoneApi();
 
 // RFID yardımcı
-String uidToHexString(const MFRC522::Uid &uid);
+void rfidInit();
+bool rfidTakeCard(CardUid &uid);
+void rfidKickReqa();
+void rfidPrintStats();
 
 // Admin Kart ekranı
 void startAdminCardScreen();
@@ -483,24 +1329,118 @@ void doFactoryReset();
 
 // RS485 / Modbus / Normal Mod
 void initRs485();
+void rs485SetBaud(uint32_t baud);
+void rs485ProbeBaud();
 uint16_t modbusCRC16(const uint8_t *data, uint16_t length);
-void rs485SetTx();
-void rs485SetRx();
-bool rs485ReadBytes(uint8_t *buf, uint16_t len, uint32_t timeoutMs);
-bool modbusWriteSingleRegister(uint8_t slaveAddr, uint16_t regAddr, uint16_t value);
-bool modbusReadHoldingRegisters(uint8_t slaveAddr, uint16_t startAddr, uint16_t quantity, uint16_t *outRegs);
-bool meterStartSession();
-bool meterRead(MeterData &out);
+uint16_t modbusCRC16Update(uint16_t crc, uint8_t b);
+#ifdef MODBUS_CRC_BENCH
+uint16_t modbusCRC16Bitwise(const uint8_t *data, uint16_t length);
+void modbusCrcBenchmark();
+#endif
+void rs485WaitForEvent();
+void rs485TxFrame(const uint8_t *frame, uint8_t len);
+size_t rs485RxAvailable();
+int  rs485RxRead(uint8_t *buf, size_t len);
+void rs485RxFlush();
+#ifdef MODBUS_SIM
+void mbSimInit();
+void mbSimUpdate();
+void mbSimHandleRequest(const uint8_t *frame, uint8_t len);
+void mbSimReply(const uint8_t *pdu, uint8_t pduLen);
+void mbSimBenchmark();
+bool mbSimEvery(uint16_t n);
+int mbSimCmpU32(const void *a, const void *b);
+#endif
+bool mbBusy();
+bool mbReady();
+void mbPoll();
+void mbRxBegin(MbTransaction &t);
+MbResult mbRxByte(MbTransaction &t, uint8_t b);
+void mbLogPrefix(const MbTransaction &t);
+void mbLogError(const MbTransaction &t, const __FlashStringHelper *msg);
+void mbLogRxError(const MbTransaction &t, MbResult result);
+void mbCapInit();
+void mbCapTx(const uint8_t *frame, uint8_t len, uint32_t tUs);
+void mbCapRx(const uint8_t *data, size_t len, uint32_t tUs);
+void mbCapRxResult(MbResult result, bool resync);
+void mbCapRxClose();
+void mbCapExport();
+void mbCapExportPump();
+void mbCapExportWrite(const uint8_t *data, size_t len);
+MbCapRecord &mbCapSlot(uint32_t n);
+void mbCapCommit();
+void mbCapAppend(MbCapRecord &r, const uint8_t *data, size_t len);
+MbCapRecord &mbCapRxOpen(uint32_t tUs);
+void handleSerialCommands();
+#ifdef MODBUS_PARSER_FUZZ
+void mbParserFuzz();
+uint16_t mbFuzzRand(uint32_t &seed);
+#endif
+const char *mbExceptionName(uint8_t code);
+const char *mbResultName(MbResult result);
+uint32_t mbSilenceUs();
+void mbFinish(MbResult result);
+bool mbSubmitFrame(const uint8_t *pdu, uint8_t pduLen, uint16_t readQty, uint16_t *outRegs,
+                   MbDoneCallback onDone, void *ctx);
+bool mbSubmit(uint8_t slaveAddr, uint8_t fc, uint16_t regAddr, uint16_t value,
+              uint16_t *outRegs, MbDoneCallback onDone, void *ctx);
+bool modbusWriteSingleRegister(uint8_t slaveAddr, uint16_t regAddr, uint16_t value,
+                               MbDoneCallback onDone, void *ctx = nullptr);
+bool modbusReadHoldingRegisters(uint8_t slaveAddr, uint16_t startAddr, uint16_t quantity, uint16_t *outRegs,
+                                MbDoneCallback onDone, void *ctx = nullptr);
+bool modbusReadWriteRegisters(uint8_t slaveAddr, uint16_t readStart, uint16_t readQty, uint16_t *outRegs,
+                              uint16_t writeStart, const uint16_t *writeRegs, uint16_t writeQty,
+                              MbDoneCallback onDone, void *ctx = nullptr);
+bool meterStartSession(Meter &m, MbDoneCallback onDone);
+bool meterStartSessionRw(Meter &m, MbDoneCallback onDone);
+bool meterRead(Meter &m, MbDoneCallback onDone);
+bool meterProbe(Meter &m, MbDoneCallback onDone);
+void meterPlanReads(const MeterRegMap &map, uint16_t fields, MeterReadPlan &plan);
 
 void drawIdleScreen();
+void segDisplayBegin(SegDisplay &d, const char *unit);
+void segDisplaySet(SegDisplay &d, uint32_t valueCenti);
+int16_t segCellX(const SegDisplay &d, uint8_t i);
+void segDrawCell(SegDisplay &d, uint8_t i, uint8_t mask);
+void fuelEstReset(const MeterData &md, uint32_t nowMs);
+void fuelEstSample(const MeterData &md, uint32_t sampleMs);
+void fuelEstAdvance(uint32_t nowMs);
 void handleTouchOnIdle();
-void drawFuelingScreen(const MeterData &md);
+void drawFuelingScreen(const MeterData &md, bool full = true);
 void handleTouchOnFueling();
 void drawFuelSummaryScreen();
 void handleTouchOnFuelSummary();
 void handleRfidInNormalMode();
+void handleSessionStart();
+bool sessionStartWaitingForBus();
+void sessionStartBegin(Meter &m);
+void sessionStartFinish(Meter &m, bool haveStatus);
+void onSessionStartRwDone(MbResult result, void *ctx);
+void onSessionStartCmdDone(MbResult result, void *ctx);
+void onSessionStartStatusDone(MbResult result, void *ctx);
+void onSessionStartVerifyDone(MbResult result, void *ctx);
 void handleMeterPolling();
-int  findDriverIndexByUid(const String &uidHex);
+void rs485Task(void *arg);
+void rs485StartTask();
+void rs485HandleCommands();
+bool meterEvtPush(const MeterEvent &e);
+bool meterEvtPop(MeterEvent &e);
+void meterPublish(uint8_t idx);
+void meterPublishPending();
+void sessionStartPublish(uint8_t kind, const Meter &m);
+void handleMeterEvents();
+void meterUpdateStats(Meter &m, MbResult result);
+uint16_t meterChooseInterval(Meter &m, const MeterData &prev);
+uint8_t meterIntervalTier(uint16_t intervalMs);
+void onMeterPollDone(MbResult result, void *ctx);
+void onMeterProbeDone(MbResult result, void *ctx);
+void meterOnFailure(Meter &m, MbResult result);
+void meterResetHealth(Meter &m);
+uint32_t meterNextDelayMs(const Meter &m);
+uint32_t meterLatencyPercentileMs(const MeterPollStats &st, uint8_t pct);
+void meterPrintStats(const Meter &m);
+int  meterFindIdle();
+int32_t findDriverIndexByUid(const CardUid &uid);
 bool isNormalModeConfigComplete();
 
 // -----------------------------------------------------------------------------
@@ -508,6 +1448,9 @@ bool isNormalModeConfigComplete();
 // -----------------------------------------------------------------------------
 void setup()
 {
+  // 'm' aktarimi loop()'u bekletmeden yazabilsin diye TX tamponu
+  // (bkz. MB_CAP_EXPORT_CHUNK); varsayilan 0'da her yazma FIFO'yu bekler
+  Serial.setTxBufferSize(2 * MB_CAP_EXPORT_CHUNK);
   Serial.begin(115200);
   delay(200);
 
@@ -526,30 +1469,46 @@ void setup()
   tft.init();
   tft.setRotation(3);
 
-  SPI.begin(TFT_SCLK, TFT_MISO, TFT_MOSI, TFT_CS);
-  g_spiOwner = SPI_OWNER_TFT;
-
-  ts.begin();
+  // Dokunmatik ekranla ayni (HSPI) hatta; RFID global SPI'da (VSPI) kalici
+  ts.begin(tft.getSPIinstance());
   ts.setRotation(3);
 
-  spr.setColorDepth(16);
-  void *buf = spr.createSprite(tft.width(), tft.height());
-  if (!buf) {
+  bool bands = LCD_BAND_RENDER || !psramFound();
+  if (!bands && !spr.begin(tft.width(), tft.height(), false)) {
+    Serial.println(F("UYARI: Tam ekran sprite ayrilamadi, serit moduna geciliyor."));
+    bands = true;
+  }
+  if (bands && !spr.begin(tft.width(), tft.height(), true)) {
     Serial.println(F("HATA: Sprite icin bellek ayrilamadi!"));
+  } else if (bands) {
+    Serial.printf("Serit cizim: %dx%d ekran, %d satirlik serit (dahili RAM)\n",
+                  spr.width(), spr.height(), LCD_BAND_LINES);
   } else {
     Serial.printf("Sprite olusturuldu (%dx%d)\n", spr.width(), spr.height());
   }
-  spr.fillSprite(TFT_BLACK);
-  spr.pushSprite(0, 0);
+
+  sprTop.setColorDepth(16);
+  g_topBar.ownSprite = g_topCanvas.begin(tft.width(), TOP_BAR_H, false);
+  if (!g_topBar.ownSprite) {
+    Serial.println(F("UYARI: Ust bar sprite'i ayrilamadi, ana sprite kullanilacak."));
+  }
+
+  lcdInitDma();
+
+  rfidInit();
+
+  sprClear(TFT_BLACK);
+  sprPresent();
 
   initConfigDefaults();
+  driverStoreBegin();
   loadConfigFromNVS();
 
   // RS485 başlat
   initRs485();
 
   // Açılışta kullanıcı ayarları kontrolü
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar("Baslangic");
   spr.setTextDatum(MC_DATUM);
   spr.setTextFont(FONT_MAIN);
@@ -561,7 +1520,7 @@ void setup()
 
   spr.drawString("Kullanici ayarlari", sw / 2, centerY - 10);
   spr.drawString("kontrol ediliyor...", sw / 2, centerY + 10);
-  spr.pushSprite(0, 0);
+  sprPresent();
 
   Serial.println(F("Kullanici ayarlari kontrol ediliyor..."));
   delay(1000);
@@ -572,14 +1531,14 @@ void setup()
   {
     Serial.println(F("Tum ayarlar tam. WiFi baglantisi denenecek."));
 
-    spr.fillSprite(TFT_BLACK);
+    sprClear(TFT_BLACK);
     drawTopBar("Baslangic");
     spr.setTextDatum(MC_DATUM);
     spr.setTextFont(FONT_MAIN);
     spr.setTextColor(TFT_WHITE, TFT_BLACK);
     spr.drawString("Ayarlar tamam.", sw / 2, centerY - 10);
     spr.drawString("WiFi'ya baglaniliyor...", sw / 2, centerY + 10);
-    spr.pushSprite(0, 0);
+    sprPresent();
 
     bool wifiOk = wifiAttemptConnectBlocking(config.wifi.ssid, config.wifi.password);
     if (wifiOk)
@@ -592,14 +1551,14 @@ void setup()
     {
       Serial.println(F("WiFi baglanamadi. Ayarlar menusune geciliyor."));
 
-      spr.fillSprite(TFT_BLACK);
+      sprClear(TFT_BLACK);
       drawTopBar("Baslangic");
       spr.setTextDatum(MC_DATUM);
       spr.setTextFont(FONT_MAIN);
       spr.setTextColor(TFT_YELLOW, TFT_BLACK);
       spr.drawString("WiFi baglanamadi.", sw / 2, centerY - 10);
       spr.drawString("Ayarlar ekranina gidiliyor.", sw / 2, centerY + 10);
-      spr.pushSprite(0, 0);
+      sprPresent();
       delay(1500);
 
       currentScreen = SCR_SETUP_MENU;
@@ -610,20 +1569,33 @@ void setup()
   {
     Serial.println(F("Eksik ayar var. Kurulum menusu ile baslaniyor."));
 
-    spr.fillSprite(TFT_BLACK);
+    sprClear(TFT_BLACK);
     drawTopBar("Baslangic");
     spr.setTextDatum(MC_DATUM);
     spr.setTextFont(FONT_MAIN);
     spr.setTextColor(TFT_YELLOW, TFT_BLACK);
     spr.drawString("Eksik ayar var.", sw / 2, centerY - 10);
     spr.drawString("Ayarlar ekranina gidiliyor.", sw / 2, centerY + 10);
-    spr.pushSprite(0, 0);
+    sprPresent();
     delay(1500);
 
     currentScreen = SCR_SETUP_MENU;
     drawSetupMenu();
   }
 
+#ifdef MODBUS_CRC_BENCH
+  modbusCrcBenchmark();
+#endif
+#ifdef DRIVER_STORE_BENCH
+  driverStoreBenchmark();
+#endif
+#ifdef DRIVER_STORE_SELFTEST
+  driverStoreSelfTest();
+#endif
+#ifdef MODBUS_PARSER_FUZZ
+  mbParserFuzz();
+#endif
+
   Serial.println(F("Hazir."));
 }
 
@@ -634,6 +1606,11 @@ void loop()
 {
   handleWifiAndTime();
 
+  // RS485 gorevinden gelen sayac ornekleri / dolum sonuclari
+  handleMeterEvents();
+
+  handleSerialCommands();
+
   unsigned long nowMs = millis();
   if (nowMs - lastTopBarUpdateMs >= 1000) {
     lastTopBarUpdateMs = nowMs;
@@ -685,7 +1662,6 @@ void loop()
 
     case SCR_FUELING:
       handleTouchOnFueling();
-      handleMeterPolling();
       break;
 
     case SCR_FUEL_SUMMARY:
@@ -744,15 +1720,8 @@ void initConfigDefaults()
   config.phoneApi.apiKey      = "";
   config.phoneApi.isSet       = false;
 
-  config.adminCard.uidHex = "";
-  config.adminCard.isSet  = false;
-
-  config.drivers.count = 0;
-  for (uint8_t i = 0; i < MAX_DRIVERS; i++)
-  {
-    config.drivers.items[i].uidHex = "";
-    config.drivers.items[i].plate  = "";
-  }
+  config.adminCard.uid.len = 0;
+  config.adminCard.isSet   = false;
 }
 
 // -----------------------------------------------------------------------------
@@ -775,30 +1744,51 @@ void loadConfigFromNVS()
   config.phoneApi.isSet       =
       (config.phoneApi.phoneNumber.length() > 0 && config.phoneApi.apiKey.length() > 0);
 
-  config.adminCard.uidHex = prefs.getString("admin_uid", "");
-  config.adminCard.isSet  = (config.adminCard.uidHex.length() > 0);
+  config.adminCard.isSet = cardUidFromHex(prefs.getString("admin_uid", ""), config.adminCard.uid);
 
-  uint32_t drvCount = prefs.getUInt("drv_count", 0);
-  if (drvCount > MAX_DRIVERS) drvCount = MAX_DRIVERS;
-  config.drivers.count = (uint8_t)drvCount;
-
-  for (uint8_t i = 0; i < config.drivers.count; i++)
+  // Eski surum: sofor kartlari NVS'de (drv_uid_N / drv_lic_N). Depo bossa
+  // bir kez tasinir; okunamayan UID atlanir. Eski anahtarlar ancak kartlar
+  // flash'a yazildiktan sonra silinir: depo kalici degilse sonraki acilista
+  // tasima tekrarlanir, silme yarida kaldiysa sonraki acilista tamamlanir.
+  uint32_t drvCount   = prefs.getUInt("drv_count", 0);
+  bool     dropLegacy = drvCount > 0 && g_drivers.part && g_drivers.live > 0;
+  if (g_drivers.live == 0 && drvCount > 0)
   {
-    String keyUid   = "drv_uid_" + String(i);
-    String keyPlate = "drv_lic_" + String(i);
+    for (uint32_t i = 0; i < drvCount && i < DRIVER_LEGACY_NVS_MAX; i++)
+    {
+      String keyUid   = "drv_uid_" + String(i);
+      String keyPlate = "drv_lic_" + String(i);
 
-    config.drivers.items[i].uidHex = prefs.getString(keyUid.c_str(), "");
-    config.drivers.items[i].plate  = prefs.getString(keyPlate.c_str(), "");
+      CardUid uid;
+      if (!cardUidFromHex(prefs.getString(keyUid.c_str(), ""), uid)) continue;
+      configAddOrUpdateDriver(uid, prefs.getString(keyPlate.c_str(), ""), false);
+    }
+    dropLegacy = driverStoreSaveAll(g_drivers);
+    Serial.printf("  NVS'den %lu sofor karti depoya tasindi\n", (unsigned long)g_drivers.live);
   }
 
   prefs.end();
 
+  if (dropLegacy && prefs.begin("fuelterm", false))
+  {
+    for (uint32_t i = 0; i < DRIVER_LEGACY_NVS_MAX; i++)
+    {
+      String keyUid   = "drv_uid_" + String(i);
+      String keyPlate = "drv_lic_" + String(i);
+      prefs.remove(keyUid.c_str());
+      prefs.remove(keyPlate.c_str());
+    }
+    prefs.remove("drv_count");
+    prefs.end();
+    Serial.println(F("  Eski NVS sofor anahtarlari silindi"));
+  }
+
   Serial.println(F("NVS'den konfig yüklendi:"));
   Serial.printf("  WiFi: %s\n",  config.wifi.isSet      ? config.wifi.ssid.c_str()      : "YOK");
   Serial.printf("  Tel: %s\n",   config.phoneApi.isSet  ? config.phoneApi.phoneNumber.c_str() : "YOK");
   Serial.printf("  API: %s\n",   config.phoneApi.isSet  ? "VAR" : "YOK");
-  Serial.printf("  Admin UID: %s\n", config.adminCard.isSet ? config.adminCard.uidHex.c_str() : "YOK");
-  Serial.printf("  Sofor kart sayisi: %u\n", config.drivers.count);
+  Serial.printf("  Admin UID: %s\n", config.adminCard.isSet ? cardUidToHex(config.adminCard.uid).c_str() : "YOK");
+  Serial.printf("  Sofor kart sayisi: %lu\n", (unsigned long)g_drivers.live);
 }
 
 // -----------------------------------------------------------------------------
@@ -818,17 +1808,9 @@ void saveConfigToNVS()
   prefs.putString("phone",   config.phoneApi.phoneNumber);
   prefs.putString("api_key", config.phoneApi.apiKey);
 
-  prefs.putString("admin_uid", config.adminCard.uidHex);
+  prefs.putString("admin_uid", config.adminCard.isSet ? cardUidToHex(config.adminCard.uid) : String(""));
 
-  prefs.putUInt("drv_count", config.drivers.count);
-  for (uint8_t i = 0; i < config.drivers.count; i++)
-  {
-    String keyUid   = "drv_uid_" + String(i);
-    String keyPlate = "drv_lic_" + String(i);
-
-    prefs.putString(keyUid.c_str(),   config.drivers.items[i].uidHex);
-    prefs.putString(keyPlate.c_str(), config.drivers.items[i].plate);
-  }
+  // Sofor kartlari NVS'de degil, sofor deposunda (driverStoreWritePage)
 
   prefs.end();
   Serial.println(F("Konfig NVS'ye kaydedildi."));
@@ -856,77 +1838,781 @@ void configSetPhoneApi(const String &phone, const String &apiKey, bool save)
   if (save) saveConfigToNVS();
 }
 
-void configSetAdminCard(const String &uidHex, bool save)
+void configSetAdminCard(const CardUid &uid, bool save)
 {
-  config.adminCard.uidHex = uidHex;
-  config.adminCard.isSet  = (uidHex.length() > 0);
+  config.adminCard.uid   = uid;
+  config.adminCard.isSet = (uid.len > 0);
 
   if (save) saveConfigToNVS();
 }
 
-bool configAddOrUpdateDriver(const String &uidHex, const String &plate, bool save)
+// save = false: sadece PSRAM; cagiran sonra driverStoreSaveAll() ile yazar
+bool configAddOrUpdateDriver(const CardUid &uid, const String &plate, bool save)
 {
-  for (uint8_t i = 0; i < config.drivers.count; i++)
-  {
-    if (config.drivers.items[i].uidHex == uidHex)
-    {
-      config.drivers.items[i].plate = plate;
-      if (save) saveConfigToNVS();
-      return true;
-    }
-  }
+  // Flash yazimi basarisizsa (loglandi) kart bu acilis icin yine gecerli;
+  // false sadece liste doluysa
+  if (driverStorePut(g_drivers, uid, plate.c_str(), save)) return true;
+  return driverStoreFind(g_drivers, uid) >= 0;
+}
 
-  if (config.drivers.count >= MAX_DRIVERS)
-  {
-    Serial.println(F("Sofor kart listesi dolu! Yeni kart eklenemedi."));
-    return false;
-  }
+// -----------------------------------------------------------------------------
+// Kart UID anahtari
+// -----------------------------------------------------------------------------
+// FNV-1a; uzunluk da karistirilir (4 ve 7 baytlik UID ayni onekle baslayabilir)
+uint32_t cardUidHash(const CardUid &u)
+{
+  uint32_t h = 2166136261u;
+  h = (h ^ u.len) * 16777619u;
+  for (uint8_t i = 0; i < u.len; i++) h = (h ^ u.b[i]) * 16777619u;
+  return h;
+}
 
-  uint8_t idx = config.drivers.count;
-  config.drivers.items[idx].uidHex = uidHex;
-  config.drivers.items[idx].plate  = plate;
-  config.drivers.count++;
+bool cardUidEqual(const CardUid &a, const CardUid &b)
+{
+  return a.len == b.len && memcmp(a.b, b.b, a.len) == 0;
+}
 
-  if (save) saveConfigToNVS();
-  return true;
+// "AA:BB:CC:DD" (ayiricisiz da kabul edilir); bos veya bozuksa false
+bool cardUidFromHex(const String &hex, CardUid &out)
+{
+  out.len = 0;
+  int8_t hi = -1;
+  for (size_t i = 0; i < hex.length(); i++)
+  {
+    char c = hex[i];
+    int8_t v;
+    if (c >= '0' && c <= '9')      v = c - '0';
+    else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+    else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+    else if (c == ':' && hi < 0)   continue;
+    else { out.len = 0; return false; }
+
+    if (hi < 0) { hi = v; continue; }
+    if (out.len >= CARD_UID_MAX) { out.len = 0; return false; }
+    out.b[out.len++] = (uint8_t)((hi << 4) | v);
+    hi = -1;
+  }
+  if (hi >= 0) out.len = 0;
+  return out.len > 0;
 }
 
-int findDriverIndexByUid(const String &uidHex)
+// Heap'siz hex: outLen >= 3 * CARD_UID_MAX yeterli
+void cardUidFormat(const CardUid &u, char *out, size_t outLen)
 {
-  for (uint8_t i = 0; i < config.drivers.count; i++)
+  static const char HEX_DIGITS[] = "0123456789ABCDEF";
+  size_t n = 0;
+  for (uint8_t i = 0; i < u.len; i++)
   {
-    if (config.drivers.items[i].uidHex == uidHex)
-      return (int)i;
+    if (n + (i > 0 ? 3 : 2) >= outLen) break;
+    if (i > 0) out[n++] = ':';
+    out[n++] = HEX_DIGITS[u.b[i] >> 4];
+    out[n++] = HEX_DIGITS[u.b[i] & 0x0F];
   }
-  return -1;
+  out[n] = '\0';
 }
 
-// Normal moda gecmek icin gerekli asgari alanlar:
-// - WiFi ayarli
-// - Yonetici kart tanimli
-// - En az 1 sofor karti kayitli
-// Telefon / API artik opsiyonel (dahili log kullandigimiz icin)
-bool isNormalModeConfigComplete()
+String cardUidToHex(const CardUid &u)
 {
-  return config.wifi.isSet &&
-         config.adminCard.isSet &&
-         (config.drivers.count > 0);
+  char buf[3 * CARD_UID_MAX];
+  cardUidFormat(u, buf, sizeof(buf));
+  return String(buf);
 }
 
 // -----------------------------------------------------------------------------
-// Bir buton için konfig durumu [OK] / [X]
+// Sofor kart deposu
 // -----------------------------------------------------------------------------
-bool isConfigOkForButton(ButtonId id)
+bool driverStoreAlloc(DriverStore &st, uint32_t capacity)
 {
-  switch (id)
-  {
-    case BTN_WIFI:
-      // WiFi ayarlari yapilmis mi?
-      return config.wifi.isSet;
+  memset(&st, 0, sizeof(st));
+
+  uint32_t slots = 1;
+  while (slots < 2 * capacity) slots <<= 1;
+
+  size_t recBytes = capacity * sizeof(DriverRecord);
+  size_t idxBytes = slots * sizeof(uint16_t);
+  if (psramFound()) {
+    st.recs  = (DriverRecord *)ps_malloc(recBytes);
+    st.index = (uint16_t *)ps_malloc(idxBytes);
+  } else {
+    st.recs  = (DriverRecord *)malloc(recBytes);
+    st.index = (uint16_t *)malloc(idxBytes);
+  }
+  if (!st.recs || !st.index) {
+    driverStoreFree(st);
+    return false;
+  }
+
+  st.capacity  = capacity;
+  st.indexMask = slots - 1;
+  memset(st.index, 0xFF, idxBytes);
+  return true;
+}
+
+void driverStoreFree(DriverStore &st)
+{
+  free(st.recs);
+  free(st.index);
+  free(st.pageSector);
+  free(st.sectorPage);
+  st.recs       = nullptr;
+  st.index      = nullptr;
+  st.pageSector = nullptr;
+  st.sectorPage = nullptr;
+  st.capacity   = 0;
+  st.count      = 0;
+  st.live       = 0;
+  st.part       = nullptr;
+}
+
+// setup(): depo ayrilir ve flash'tan yuklenir (NVS'den once: eski kayit tasima)
+void driverStoreBegin()
+{
+  const esp_partition_t *part =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "drivers");
+#ifdef DRIVER_STORE_SPIFFS_FALLBACK
+  if (!part) {
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+    if (part)
+      Serial.printf("UYARI: \"drivers\" bolumu yok, SPIFFS bolumu \"%s\" sofor deposu olarak kullaniliyor "
+                    "(icerigi silinir)\n", part->label);
+  }
+#endif
+
+  // Bir sektor yedek: guncel kopya silinmeden yenisi yazilabilsin
+  uint32_t capacity = psramFound() ? DRIVER_CAPACITY : DRIVER_CAPACITY_NO_PSRAM;
+  uint32_t sectors  = part ? part->size / DRIVER_PAGE_SIZE : 0;
+  if (sectors >= 2 && (sectors - 1) * DRIVER_PAGE_RECS < capacity)
+    capacity = (sectors - 1) * DRIVER_PAGE_RECS;
+
+  while (!driverStoreAlloc(g_drivers, capacity) && capacity > DRIVER_CAPACITY_NO_PSRAM)
+    capacity /= 2;
+  if (!g_drivers.recs) {
+    Serial.println(F("HATA: Sofor deposu icin bellek ayrilamadi!"));
+    return;
+  }
+
+  if (!driverStoreAttach(g_drivers, part))
+    Serial.println(F("UYARI: Sofor deposu icin flash bolumu yok (partitions.csv?), kartlar kalici degil."));
+
+  driverStoreLoad(g_drivers);
+
+  Serial.printf("Sofor deposu: %lu kart / %lu kapasite, %lu ms'de yuklendi, %lu KB %s (%s)\n",
+                (unsigned long)g_drivers.live, (unsigned long)g_drivers.capacity,
+                (unsigned long)(g_drivers.loadUs / 1000),
+                (unsigned long)((g_drivers.capacity * sizeof(DriverRecord) +
+                                 (g_drivers.indexMask + 1) * sizeof(uint16_t)) / 1024),
+                psramFound() ? "PSRAM" : "RAM", g_drivers.part ? g_drivers.part->label : "-");
+}
+
+// Bolumu depoya baglar: sayfa <-> sektor tablolari (dahili RAM, sektor
+// basina 2 + sayfa basina 2 bayt). Bolum cok kucukse depo kalici olmaz.
+bool driverStoreAttach(DriverStore &st, const esp_partition_t *part)
+{
+  st.part = nullptr;
+  uint32_t sectors = part ? part->size / DRIVER_PAGE_SIZE : 0;
+  if (sectors > DRIVER_SECTOR_NONE) sectors = DRIVER_SECTOR_NONE;
+  if (sectors < 2) return false;
+
+  uint32_t pages = (st.capacity + DRIVER_PAGE_RECS - 1) / DRIVER_PAGE_RECS;
+  if (pages > sectors - 1) return false;
+
+  st.pageSector = (uint16_t *)malloc(pages * sizeof(uint16_t));
+  st.sectorPage = (uint16_t *)malloc(sectors * sizeof(uint16_t));
+  if (!st.pageSector || !st.sectorPage) {
+    free(st.pageSector);
+    free(st.sectorPage);
+    st.pageSector = st.sectorPage = nullptr;
+    return false;
+  }
+  memset(st.pageSector, 0xFF, pages * sizeof(uint16_t));
+  memset(st.sectorPage, 0xFF, sectors * sizeof(uint16_t));
+
+  st.part       = part;
+  st.sectors    = sectors;
+  st.seq        = 0;
+  st.nextSector = 0;
+  return true;
+}
+
+uint16_t driverPageCrc(const DriverPageHeader &h, const DriverRecord *recs)
+{
+  uint16_t crc = 0xFFFF;
+  const uint8_t *p = (const uint8_t *)&h + offsetof(DriverPageHeader, seq);
+  for (size_t i = 0; i < offsetof(DriverPageHeader, crc) - offsetof(DriverPageHeader, seq); i++)
+    crc = modbusCRC16Update(crc, p[i]);
+
+  p = (const uint8_t *)recs;
+  for (size_t i = 0; i < h.count * sizeof(DriverRecord); i++)
+    crc = modbusCRC16Update(crc, p[i]);
+  return crc;
+}
+
+// Iki gecis: once tum basliklar (sektor basina 16 bayt), sonra her sayfanin
+// en yuksek seq'li adayi okunup CRC ile dogrulanir; tutmazsa bir onceki
+// kopyaya dusulur. Hicbir kopyasi saglam olmayan sayfanin kayitlari bos
+// kalir, sonraki sayfalar etkilenmez.
+void driverStoreLoad(DriverStore &st)
+{
+  uint32_t t0 = micros();
+  st.count = 0;
+  st.live  = 0;
+
+  uint32_t  pages = (st.capacity + DRIVER_PAGE_RECS - 1) / DRIVER_PAGE_RECS;
+  uint32_t *seqs  = st.part ? (uint32_t *)malloc(st.sectors * sizeof(uint32_t)) : nullptr;
+  uint8_t  *buf   = st.part ? (uint8_t *)malloc(DRIVER_PAGE_SIZE) : nullptr;
+  if (st.part && (!seqs || !buf))
+    Serial.println(F("HATA: Sofor deposu yuklenemedi, bellek yok"));
+
+  if (seqs && buf) {
+    uint32_t newest = 0;
+    for (uint32_t s = 0; s < st.sectors; s++) {
+      DriverPageHeader h;
+      st.sectorPage[s] = DRIVER_SECTOR_NONE;
+      if (driverFlashRead(st, s * DRIVER_PAGE_SIZE, &h, sizeof(h)) != ESP_OK) continue;
+      if (h.magic != DRIVER_PAGE_MAGIC || h.count > DRIVER_PAGE_RECS) continue;
+
+      // Kapasite disindaki sayfalar da (PSRAM'siz acilis) dolu sayilir, ezilmez
+      st.sectorPage[s] = h.page;
+      seqs[s] = h.seq;
+      if (h.seq >= st.seq) {
+        st.seq = h.seq;
+        newest = s;
+      }
+    }
+    st.nextSector = (newest + 1) % st.sectors;
+
+    for (uint32_t p = 0; p < pages; p++) {
+      uint32_t first = p * DRIVER_PAGE_RECS;
+      uint32_t room  = st.capacity - first;
+      if (room > DRIVER_PAGE_RECS) room = DRIVER_PAGE_RECS;
+      memset(&st.recs[first], 0, room * sizeof(DriverRecord));
+
+      for (;;) {
+        uint32_t best = DRIVER_SECTOR_NONE;
+        for (uint32_t s = 0; s < st.sectors; s++) {
+          if (st.sectorPage[s] == p && (best == DRIVER_SECTOR_NONE || seqs[s] > seqs[best])) best = s;
+        }
+        if (best == DRIVER_SECTOR_NONE) break;
+
+        const DriverPageHeader &h = *(const DriverPageHeader *)buf;
+        const DriverRecord *src = (const DriverRecord *)(buf + sizeof(DriverPageHeader));
+        if (driverFlashRead(st, best * DRIVER_PAGE_SIZE, buf, DRIVER_PAGE_SIZE) == ESP_OK &&
+            driverPageCrc(h, src) == h.crc) {
+          uint32_t n = h.count < room ? h.count : room;
+          memcpy(&st.recs[first], src, n * sizeof(DriverRecord));
+          if (n > 0 && first + n > st.count) st.count = first + n;
+          st.pageSector[p] = (uint16_t)best;
+          break;
+        }
+
+        Serial.printf("UYARI: Sofor deposu sayfa %lu (sektor %lu) bozuk, onceki kopya deneniyor\n",
+                      (unsigned long)p, (unsigned long)best);
+        st.sectorPage[best] = DRIVER_SECTOR_NONE;
+      }
+    }
+
+    // Guncel olmayan kopyalar bos sektor sayilir
+    for (uint32_t s = 0; s < st.sectors; s++) {
+      uint16_t p = st.sectorPage[s];
+      if (p < pages && st.pageSector[p] != s) st.sectorPage[s] = DRIVER_SECTOR_NONE;
+    }
+  }
+  free(seqs);
+  free(buf);
+
+  for (uint32_t i = 0; i < st.count; i++) {
+    DriverRecord &r = st.recs[i];
+    if (r.uid.len > CARD_UID_MAX) r.uid.len = 0;
+    r.plate[DRIVER_PLATE_LEN - 1] = '\0';
+    if (r.uid.len > 0) st.live++;
+  }
+
+  driverStoreIndexRebuild(st);
+  st.loadUs = micros() - t0;
+}
+
+// Guncel kopya tasimayan ilk sektor (son yazilandan sonra, sirayla)
+uint32_t driverStoreFreeSector(const DriverStore &st)
+{
+  for (uint32_t i = 0; i < st.sectors; i++) {
+    uint32_t s = (st.nextSector + i) % st.sectors;
+    if (st.sectorPage[s] == DRIVER_SECTOR_NONE) return s;
+  }
+  return DRIVER_SECTOR_NONE;
+}
+
+bool driverStoreWritePage(DriverStore &st, uint32_t page)
+{
+  if (!st.part) return false;
+
+  uint32_t first = page * DRIVER_PAGE_RECS;
+  uint32_t n     = st.count - first;
+  if (n > DRIVER_PAGE_RECS) n = DRIVER_PAGE_RECS;
+
+  uint32_t sector = driverStoreFreeSector(st);
+  if (sector == DRIVER_SECTOR_NONE) {
+    Serial.println(F("HATA: Sofor deposunda bos sektor yok"));
+    return false;
+  }
+
+  // Yarim kalan bir yazimin seq'i tekrar kullanilmaz
+  DriverPageHeader h;
+  h.magic    = DRIVER_PAGE_MAGIC;
+  h.seq      = ++st.seq;
+  h.page     = (uint16_t)page;
+  h.count    = (uint16_t)n;
+  h.reserved = 0xFFFF;
+  h.crc      = driverPageCrc(h, &st.recs[first]);
+
+  size_t off = sector * DRIVER_PAGE_SIZE;
+  esp_err_t err = driverFlashErase(st, off);
+  if (err == ESP_OK) err = driverFlashWrite(st, off + sizeof(h), &st.recs[first], n * sizeof(DriverRecord));
+  if (err == ESP_OK) err = driverFlashWrite(st, off, &h, sizeof(h));
+
+  st.nextSector = (sector + 1) % st.sectors;
+  if (err != ESP_OK) {
+    Serial.printf("HATA: Sofor deposu sayfa %lu yazilamadi (%d)\n", (unsigned long)page, (int)err);
+    return false;
+  }
+
+  uint16_t old = st.pageSector[page];
+  if (old != DRIVER_SECTOR_NONE) st.sectorPage[old] = DRIVER_SECTOR_NONE;
+  st.pageSector[page]   = (uint16_t)sector;
+  st.sectorPage[sector] = (uint16_t)page;
+  return true;
+}
+
+bool driverStoreSaveAll(DriverStore &st)
+{
+  if (!st.part) return false;
+
+  uint32_t pages = (st.count + DRIVER_PAGE_RECS - 1) / DRIVER_PAGE_RECS;
+  for (uint32_t p = 0; p < pages; p++) {
+    if (!driverStoreWritePage(st, p)) return false;
+  }
+  return true;
+}
+
+// Kart ekler ya da plakasini gunceller; save ise sadece ilgili sayfa yazilir
+bool driverStorePut(DriverStore &st, const CardUid &uid, const char *plate, bool save)
+{
+  if (!st.recs) return false;
+
+  int32_t idx = driverStoreFind(st, uid);
+  if (idx < 0)
+  {
+    if (st.count >= st.capacity)
+    {
+      Serial.println(F("Sofor kart listesi dolu! Yeni kart eklenemedi."));
+      return false;
+    }
+    idx = (int32_t)st.count++;
+    st.live++;
+    st.recs[idx].uid = uid;
+    driverStoreIndexInsert(st, (uint32_t)idx);
+  }
+
+  DriverRecord &r = st.recs[idx];
+  memset(r.plate, 0, sizeof(r.plate));
+  strncpy(r.plate, plate, DRIVER_PLATE_LEN - 1);
+  r.reserved = 0;
+
+  if (!save) return true;
+  return driverStoreWritePage(st, (uint32_t)idx / DRIVER_PAGE_RECS);
+}
+
+// Fabrika ayari: basligi bos olmayan her sektor silinir (eski kopyalar da,
+// yoksa yuklemede geri gelirlerdi)
+void driverStoreErase()
+{
+  DriverStore &st = g_drivers;
+  if (!st.part) return;
+
+  for (uint32_t s = 0; s < st.sectors; s++) {
+    uint32_t magic;
+    if (driverFlashRead(st, s * DRIVER_PAGE_SIZE, &magic, sizeof(magic)) == ESP_OK && magic != 0xFFFFFFFF)
+      driverFlashErase(st, s * DRIVER_PAGE_SIZE);
+  }
+}
+
+esp_err_t driverFlashRead(const DriverStore &st, size_t off, void *dst, size_t len)
+{
+#ifdef DRIVER_STORE_SELFTEST
+  if (st.part == &g_driverSimPart) {
+    memcpy(dst, g_driverSim.mem + off, len);
+    return ESP_OK;
+  }
+#endif
+  return esp_partition_read(st.part, off, dst, len);
+}
+
+esp_err_t driverFlashWrite(const DriverStore &st, size_t off, const void *src, size_t len)
+{
+#ifdef DRIVER_STORE_SELFTEST
+  if (st.part == &g_driverSimPart) {
+    if (g_driverSim.opsLeft == 0) return ESP_FAIL;
+    bool cut = g_driverSim.opsLeft > 0 && --g_driverSim.opsLeft == 0;
+    if (cut) len /= 2;
+    for (size_t i = 0; i < len; i++) g_driverSim.mem[off + i] &= ((const uint8_t *)src)[i];
+    return cut ? ESP_FAIL : ESP_OK;
+  }
+#endif
+  return esp_partition_write(st.part, off, src, len);
+}
+
+esp_err_t driverFlashErase(const DriverStore &st, size_t off)
+{
+#ifdef DRIVER_STORE_SELFTEST
+  if (st.part == &g_driverSimPart) {
+    if (g_driverSim.opsLeft == 0) return ESP_FAIL;
+    bool cut = g_driverSim.opsLeft > 0 && --g_driverSim.opsLeft == 0;
+    memset(g_driverSim.mem + off, 0xFF, cut ? DRIVER_PAGE_SIZE / 2 : DRIVER_PAGE_SIZE);
+    return cut ? ESP_FAIL : ESP_OK;
+  }
+#endif
+  return esp_partition_erase_range(st.part, off, DRIVER_PAGE_SIZE);
+}
+
+void driverStoreIndexInsert(DriverStore &st, uint32_t recIdx)
+{
+  uint32_t slot = cardUidHash(st.recs[recIdx].uid) & st.indexMask;
+  while (st.index[slot] != DRIVER_INDEX_EMPTY) slot = (slot + 1) & st.indexMask;
+  st.index[slot] = (uint16_t)recIdx;
+}
+
+void driverStoreIndexRebuild(DriverStore &st)
+{
+  memset(st.index, 0xFF, (st.indexMask + 1) * sizeof(uint16_t));
+  for (uint32_t i = 0; i < st.count; i++) {
+    if (st.recs[i].uid.len > 0) driverStoreIndexInsert(st, i);
+  }
+}
+
+// Kart okutmada yetki kontrolu: heap yok, String yok; bos slota gelince biter
+int32_t driverStoreFind(const DriverStore &st, const CardUid &uid)
+{
+  if (!st.index || uid.len == 0) return -1;
+
+  uint32_t slot = cardUidHash(uid) & st.indexMask;
+  for (;;) {
+    uint16_t idx = st.index[slot];
+    if (idx == DRIVER_INDEX_EMPTY) return -1;
+    if (cardUidEqual(st.recs[idx].uid, uid)) return idx;
+    slot = (slot + 1) & st.indexMask;
+  }
+}
+
+int32_t findDriverIndexByUid(const CardUid &uid)
+{
+  return driverStoreFind(g_drivers, uid);
+}
+
+#ifdef DRIVER_STORE_BENCH
+// -DDRIVER_STORE_BENCH ile derlenirse setup() sonunda calisir: 1k/10k/50k
+// sentetik kart icin ayrilan bellek, yuklemenin parcalari (baslik tarama ve
+// sayfa okuma - bolumden salt okunur -, sayfa CRC'leri, indeks kurma),
+// ortalama / en kotu deneme sayisi (isabet ve iskalama ayri) ve arama
+// sureleri. Gercek depoya ve flash'a yazmaz.
+uint32_t driverStoreProbes(const DriverStore &st, const CardUid &uid)
+{
+  uint32_t slot = cardUidHash(uid) & st.indexMask;
+  uint32_t n = 1;
+  while (st.index[slot] != DRIVER_INDEX_EMPTY && !cardUidEqual(st.recs[st.index[slot]].uid, uid)) {
+    slot = (slot + 1) & st.indexMask;
+    n++;
+  }
+  return n;
+}
+
+void driverStoreBenchmark()
+{
+  const uint32_t sizes[3] = { 1000, 10000, 50000 };
+  const uint32_t LOOKUPS  = 20000;
+
+  for (uint8_t s = 0; s < 3; s++) {
+    uint32_t n = sizes[s];
+    DriverStore b;
+    if (!driverStoreAlloc(b, n)) {
+      Serial.printf("Sofor bench %lu: bellek yok\n", (unsigned long)n);
+      continue;
+    }
+    b.part = g_drivers.part;
+
+    // Flash okuma: yuklemedeki gibi once tum sektor basliklari, sonra dolu
+    // sayfalar kadar tam sektor (bolum yetiyorsa)
+    uint32_t headUs = 0, readUs = 0;
+    uint32_t pages = (n + DRIVER_PAGE_RECS - 1) / DRIVER_PAGE_RECS;
+    uint8_t *buf = (uint8_t *)malloc(DRIVER_PAGE_SIZE);
+    if (buf && b.part && pages * DRIVER_PAGE_SIZE <= b.part->size) {
+      uint32_t t0 = micros();
+      for (uint32_t sct = 0; sct < b.part->size / DRIVER_PAGE_SIZE; sct++)
+        driverFlashRead(b, sct * DRIVER_PAGE_SIZE, buf, sizeof(DriverPageHeader));
+      headUs = micros() - t0;
+
+      t0 = micros();
+      for (uint32_t p = 0; p < pages; p++)
+        driverFlashRead(b, p * DRIVER_PAGE_SIZE, buf, DRIVER_PAGE_SIZE);
+      readUs = micros() - t0;
+    }
+    free(buf);
+
+    uint32_t seed = 0x2545F491;
+    for (uint32_t i = 0; i < n; i++) {
+      DriverRecord &r = b.recs[i];
+      memset(&r, 0, sizeof(r));
+      r.uid.len = (i & 1) ? 4 : 7;
+      for (uint8_t k = 0; k < r.uid.len; k++) {
+        seed = seed * 1103515245UL + 12345UL;
+        r.uid.b[k] = (uint8_t)(seed >> 16);
+      }
+      snprintf(r.plate, sizeof(r.plate), "34 T %lu", (unsigned long)i);
+    }
+    b.count = b.live = n;
+
+    volatile uint16_t crcSink = 0;
+    uint32_t t1 = micros();
+    for (uint32_t p = 0; p < pages; p++) {
+      uint32_t k = n - p * DRIVER_PAGE_RECS;
+      if (k > DRIVER_PAGE_RECS) k = DRIVER_PAGE_RECS;
+      DriverPageHeader h;
+      memset(&h, 0, sizeof(h));
+      h.count = (uint16_t)k;
+      crcSink ^= driverPageCrc(h, &b.recs[p * DRIVER_PAGE_RECS]);
+    }
+    uint32_t crcUs = micros() - t1;
+    (void)crcSink;
+
+    t1 = micros();
+    driverStoreIndexRebuild(b);
+    uint32_t buildUs = micros() - t1;
+
+    // Deneme sayilari: isabet tum kayitlar, iskalama asagidaki arama kumesi
+    CardUid miss;
+    miss.len = 10;
+    uint32_t hitProbes = 0, hitMax = 0, missProbes = 0, missMax = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t k = driverStoreProbes(b, b.recs[i].uid);
+      hitProbes += k;
+      if (k > hitMax) hitMax = k;
+    }
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+      memcpy(miss.b, &i, sizeof(i));
+      memset(miss.b + sizeof(i), 0xA5, CARD_UID_MAX - sizeof(i));
+      uint32_t k = driverStoreProbes(b, miss);
+      missProbes += k;
+      if (k > missMax) missMax = k;
+    }
+
+    uint32_t mhz = ESP.getCpuFreqMHz();
+    volatile int32_t sink = 0;
+    uint32_t c0 = ESP.getCycleCount();
+    for (uint32_t i = 0; i < LOOKUPS; i++) sink += driverStoreFind(b, b.recs[(i * 7919) % n].uid);
+    uint32_t c1 = ESP.getCycleCount();
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+      memcpy(miss.b, &i, sizeof(i));
+      memset(miss.b + sizeof(i), 0xA5, CARD_UID_MAX - sizeof(i));
+      sink += driverStoreFind(b, miss);
+    }
+    uint32_t c2 = ESP.getCycleCount();
+    (void)sink;
+
+    Serial.printf("Sofor bench %5lu: kayit %lu KB + indeks %lu KB, %lu sayfa, baslik tarama %lu us, "
+                  "sayfa okuma %lu us, CRC %lu us, indeks %lu us\n",
+                  (unsigned long)n,
+                  (unsigned long)(n * sizeof(DriverRecord) / 1024),
+                  (unsigned long)((b.indexMask + 1) * sizeof(uint16_t) / 1024),
+                  (unsigned long)pages, (unsigned long)headUs, (unsigned long)readUs,
+                  (unsigned long)crcUs, (unsigned long)buildUs);
+    Serial.printf("Sofor bench %5lu: deneme isabet ort %.2f / en kotu %lu, iskalama ort %.2f / en kotu %lu, "
+                  "arama isabet %lu ns / iskalama %lu ns\n",
+                  (unsigned long)n,
+                  (float)hitProbes / n, (unsigned long)hitMax,
+                  (float)missProbes / LOOKUPS, (unsigned long)missMax,
+                  (unsigned long)((uint64_t)(c1 - c0) * 1000 / mhz / LOOKUPS),
+                  (unsigned long)((uint64_t)(c2 - c1) * 1000 / mhz / LOOKUPS));
+
+    driverStoreFree(b);
+  }
+}
+#endif
+
+#ifdef DRIVER_STORE_SELFTEST
+// -DDRIVER_STORE_SELFTEST ile derlenirse setup() sonunda calisir; gercek
+// flash'a dokunmaz. RAM'deki 8 sektorluk sahte bolume once 330 kart yazilir
+// (sayfa 0 dolu, sayfa 1 yarim). Sonra 40 adimlik ekleme / plaka guncelleme
+// dizisi (sayfa 2'ye tasar) her seferinde bir sonraki yazma/silme isleminde
+// "enerji kesilerek" tekrarlanir. Her kesintiden sonra depo yeniden yuklenir:
+// - tamamlanan adimlar aynen, yarim kalan adim eski ya da yeni haliyle olmali
+// - baska kart eklenmemis / kaybolmamis olmali
+// - kesintiden sonra eklenen kartlar eski kayitlari bozmamali.
+void driverSelfTestCard(uint32_t i, uint8_t ver, CardUid &uid, char *plate)
+{
+  memset(&uid, 0, sizeof(uid));
+  uid.len = 4;
+  memcpy(uid.b, &i, sizeof(i));
+  snprintf(plate, DRIVER_PLATE_LEN, "T%lu/%u", (unsigned long)i, ver);
+}
+
+// ver == 0: kart depoda olmamali
+bool driverSelfTestHas(const DriverStore &st, uint32_t i, uint8_t ver)
+{
+  CardUid uid;
+  char plate[DRIVER_PLATE_LEN];
+  driverSelfTestCard(i, ver, uid, plate);
+  int32_t idx = driverStoreFind(st, uid);
+  if (ver == 0) return idx < 0;
+  return idx >= 0 && strcmp(st.recs[idx].plate, plate) == 0;
+}
+
+bool driverSelfTestVerify(const DriverStore &st, const uint8_t *ver, uint32_t cards,
+                          int32_t inflight, uint8_t inflightVer)
+{
+  bool ok = true;
+  uint32_t live = 0;
+  for (uint32_t i = 0; i < cards; i++) {
+    bool has = driverSelfTestHas(st, i, ver[i]) ||
+               ((int32_t)i == inflight && driverSelfTestHas(st, i, inflightVer));
+    if (!has) {
+      Serial.printf("  kart %lu: beklenen surum %u yok\n", (unsigned long)i, ver[i]);
+      ok = false;
+    }
+    if (!driverSelfTestHas(st, i, 0)) live++;
+  }
+  if (live != st.live) {
+    Serial.printf("  canli kart %lu, beklenen %lu\n", (unsigned long)st.live, (unsigned long)live);
+    ok = false;
+  }
+  return ok;
+}
+
+bool driverSelfTestOpen(DriverStore &st)
+{
+  g_driverSim.opsLeft = -1;
+  if (!driverStoreAlloc(st, 7 * DRIVER_PAGE_RECS)) return false;
+  if (!driverStoreAttach(st, &g_driverSimPart)) {
+    driverStoreFree(st);
+    return false;
+  }
+  driverStoreLoad(st);
+  return true;
+}
+
+void driverStoreSelfTest()
+{
+  const uint32_t SECTORS = 8, BASE = 330, STEPS = 40, AFTER = 20;
+  const uint32_t CARDS = BASE + STEPS + AFTER;
+  const size_t   bytes = SECTORS * DRIVER_PAGE_SIZE;
+
+  uint8_t *image = (uint8_t *)malloc(bytes);
+  uint8_t *ver0  = (uint8_t *)calloc(CARDS, 1);
+  uint8_t *ver   = (uint8_t *)malloc(CARDS);
+  g_driverSim.mem = (uint8_t *)malloc(bytes);
+  g_driverSimPart.size = bytes;
+  strcpy(g_driverSimPart.label, "selftest");
+
+  CardUid  uid;
+  char     plate[DRIVER_PLATE_LEN];
+  uint32_t cuts = 0, fails = 0;
+  DriverStore st;
+
+  memset(g_driverSim.mem, 0xFF, bytes);
+  if (!image || !ver0 || !ver || !g_driverSim.mem || !driverSelfTestOpen(st)) {
+    Serial.println(F("Sofor self-test: bellek yok"));
+    fails++;
+  } else {
+    for (uint32_t i = 0; i < BASE; i++) {
+      driverSelfTestCard(i, 1, uid, plate);
+      driverStorePut(st, uid, plate, true);
+      ver0[i] = 1;
+    }
+    driverStoreFree(st);
+    memcpy(image, g_driverSim.mem, bytes);
+  }
+
+  for (int32_t cut = 1; fails == 0; cut++) {
+    memcpy(g_driverSim.mem, image, bytes);
+    memcpy(ver, ver0, CARDS);
+    driverSelfTestOpen(st);
+
+    // Her 4. adim var olan bir kartin plakasini degistirir, digerleri ekler
+    g_driverSim.opsLeft = cut;
+    int32_t  inflight = -1;
+    uint8_t  inflightVer = 0;
+    uint32_t next = BASE;
+    for (uint32_t k = 0; k < STEPS; k++) {
+      uint32_t i = (k % 4 == 3) ? (k * 37) % BASE : next++;
+      uint8_t  v = ver[i] + 1;
+      driverSelfTestCard(i, v, uid, plate);
+      if (!driverStorePut(st, uid, plate, true)) {
+        inflight    = (int32_t)i;
+        inflightVer = v;
+        break;
+      }
+      ver[i] = v;
+    }
+    driverStoreFree(st);
+    if (inflight < 0) break;   // dizi kesintisiz bitti: tum kesim noktalari denendi
+    cuts++;
+
+    driverSelfTestOpen(st);
+    bool ok = driverSelfTestVerify(st, ver, CARDS, inflight, inflightVer);
+    if (driverSelfTestHas(st, inflight, inflightVer)) ver[inflight] = inflightVer;
+
+    for (uint32_t j = 0; j < AFTER && ok; j++) {
+      uint32_t i = next + j;
+      driverSelfTestCard(i, 1, uid, plate);
+      ok = driverStorePut(st, uid, plate, true);
+      ver[i] = 1;
+    }
+    driverStoreFree(st);
+
+    driverSelfTestOpen(st);
+    ok = ok && driverSelfTestVerify(st, ver, CARDS, -1, 0);
+    driverStoreFree(st);
+
+    if (!ok) {
+      Serial.printf("Sofor self-test: %ld. islemde kesinti sonrasi tutarsiz\n", (long)cut);
+      fails++;
+    }
+  }
+
+  Serial.printf("Sofor self-test: %lu kesinti senaryosu, %s\n",
+                (unsigned long)cuts, fails ? "HATA" : "tamam");
+
+  free(image);
+  free(ver0);
+  free(ver);
+  free(g_driverSim.mem);
+  g_driverSim.mem = nullptr;
+}
+#endif
+
+// Normal moda gecmek icin gerekli asgari alanlar:
+// - WiFi ayarli
+// - Yonetici kart tanimli
+// - En az 1 sofor karti kayitli
+// Telefon / API artik opsiyonel (dahili log kullandigimiz icin)
+bool isNormalModeConfigComplete()
+{
+  return config.wifi.isSet &&
+         config.adminCard.isSet &&
+         (g_drivers.live > 0);
+}
+
+// -----------------------------------------------------------------------------
+// Bir buton için konfig durumu [OK] / [X]
+// -----------------------------------------------------------------------------
+bool isConfigOkForButton(ButtonId id)
+{
+  switch (id)
+  {
+    case BTN_WIFI:
+      // WiFi ayarlari yapilmis mi?
+      return config.wifi.isSet;
 
     case BTN_RFID_MENU:
       // RFID ayarlari: hem yonetici kart hem de en az 1 sofor karti olsun
-      return config.adminCard.isSet && (config.drivers.count > 0);
+      return config.adminCard.isSet && (g_drivers.live > 0);
 
     case BTN_PHONE_API:
       // Telefon / API istege bagli, ama durumunu gostermek guzel
@@ -958,373 +2644,2125 @@ void drawStatusForButton(ButtonId id, bool ok, uint16_t fillColor)
 }
 
 // -----------------------------------------------------------------------------
-// Top bar: baslik, wifi ikon, tarih/saat
+// Ekran tuvali: tam kare sprite veya display list + serit cizimi
 // -----------------------------------------------------------------------------
-const char* getScreenTitle(ScreenState s)
+bool dlInside(const SprRect &a, const SprRect &outer)
 {
-  switch (s)
-  {
-    case SCR_SETUP_MENU:            return "Ayarlar";
-    case SCR_WIFI_SETTINGS:         return "WiFi Ayarlari";
-    case SCR_PHONE_API:             return "Telefon / API";
-    case SCR_ADMIN_CARD:            return "Yonetici RFID";
-    case SCR_DRIVER_MENU:           return "RFID Ayarlari";
-    case SCR_DRIVER_CARD:           return "Yeni Sofor RFID/Plaka";
-    case SCR_DRIVER_LIST:           return "Kayitli RFID ve Plakalar";
-    case SCR_TEXT_INPUT:            return textInput.title.c_str();
-    case SCR_FACTORY_RESET_CONFIRM: return "Factory Reset";
-    case SCR_IDLE:                  return "Bekleme";
-    case SCR_FUELING:               return "Dolum";
-    case SCR_FUEL_SUMMARY:          return "Dolum Bitti";
-    case SCR_MESSAGE:               return infoMsg.title.c_str();
-    default:                        return "";
+  return a.x0 >= outer.x0 && a.x1 <= outer.x1 && a.y0 >= outer.y0 && a.y1 <= outer.y1;
+}
+
+SprRect dlBox(int32_t x, int32_t y, int32_t w, int32_t h)
+{
+  SprRect b;
+  b.x0 = x;
+  b.y0 = y;
+  b.x1 = x + w;
+  b.y1 = y + h;
+  return b;
+}
+
+bool ScreenCanvas::begin(int16_t w, int16_t h, bool bands)
+{
+  _bands = bands;
+  _w = w;
+  _h = h;
+  _spr->setColorDepth(16);
+
+  if (!bands) return _spr->createSprite(w, h) != nullptr;
+
+  // Serit ve liste dahili RAM'de: PSRAM cache'i uzerinden yazilmaz
+  _spr->setAttribute(PSRAM_ENABLE, false);
+  _ops  = (DlOp *)malloc(DL_MAX_OPS * sizeof(DlOp));
+  _pool = (char *)malloc(DL_TEXT_POOL);
+  if (!_ops || !_pool || !_spr->createSprite(w, LCD_BAND_LINES)) {
+    free(_ops);
+    free(_pool);
+    _ops  = nullptr;
+    _pool = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void ScreenCanvas::applyTextState()
+{
+  _spr->setTextFont(_font);
+  _spr->setTextSize(_size);
+  _spr->setTextDatum(_datum);
+  _spr->setTextColor(_fg, _bg);
+}
+
+// Hic yer kalmadiysa kayit atilir; ekran bir sonraki tam cizimde duzelir.
+// Opak dikdortgen, tamamen altinda kalan eski kayitlari siler: saniyelik
+// guncellenen satirlar listeyi buyutmez.
+void ScreenCanvas::addOp(const DlOp &op, bool opaque)
+{
+  if (opaque || op.kind == DL_FILL_RRECT) {
+    // Opak alanin (yuvarlak dikdortgende koseler haric arti seklindeki ic
+    // bolgenin) altinda kalan eski kayitlar ve ayni yuvarlak dikdortgen
+    // (tus/buton vurgusu) artik gorunmez
+    SprRect rows = op.box, cols = op.box;
+    if (!opaque) {
+      rows.y0 += op.r; rows.y1 -= op.r;
+      cols.x0 += op.r; cols.x1 -= op.r;
+    }
+
+    uint16_t keep = 0;
+    for (uint16_t i = 0; i < _opCount; i++) {
+      const DlOp &o = _ops[i];
+      bool covered = dlInside(o.box, rows) || dlInside(o.box, cols) ||
+                     ((o.kind == DL_FILL_RRECT || o.kind == DL_DRAW_RRECT) && !opaque &&
+                      o.x == op.x && o.y == op.y && o.w == op.w && o.h == op.h && o.r == op.r);
+      if (!covered) _ops[keep++] = o;
+    }
+    _opCount = keep;
+  }
+
+  if (_opCount >= DL_MAX_OPS) {
+    if (_overflows++ == 0) Serial.println(F("UYARI: Ekran listesi dolu, cizim atlandi."));
+    return;
+  }
+  _ops[_opCount++] = op;
+}
+
+// Havuzda sadece canli kayitlarin metinleri kalacak sekilde sikistirir.
+// Kayitlar ekleme sirasinda oldugu icin offsetler artan sirada, memmove
+// hep geriye dogru tasir.
+void ScreenCanvas::compactPool()
+{
+  uint16_t used = 0;
+  for (uint16_t i = 0; i < _opCount; i++) {
+    DlOp &o = _ops[i];
+    if (o.kind != DL_TEXT) continue;
+    uint16_t len = strlen(&_pool[o.r]) + 1;
+    memmove(&_pool[used], &_pool[o.r], len);
+    o.r = used;
+    used += len;
+  }
+  _poolUsed = used;
+}
+
+bool ScreenCanvas::addText(const char *text, uint16_t len, uint16_t &offset)
+{
+  if (_poolUsed + len + 1 > DL_TEXT_POOL) compactPool();
+  if (_poolUsed + len + 1 > DL_TEXT_POOL) return false;
+
+  offset = _poolUsed;
+  memcpy(&_pool[_poolUsed], text, len);
+  _pool[_poolUsed + len] = 0;
+  _poolUsed += len + 1;
+  return true;
+}
+
+DlOp dlShape(DlOpKind kind, int32_t x, int32_t y, int32_t w, int32_t h,
+                    int32_t r, uint32_t color)
+{
+  DlOp op;
+  memset(&op, 0, sizeof(op));
+  op.kind  = kind;
+  op.x     = x;
+  op.y     = y;
+  op.w     = w;
+  op.h     = h;
+  op.r     = r;
+  op.color = color;
+  op.box   = dlBox(x, y, w, h);
+  return op;
+}
+
+void ScreenCanvas::fillSprite(uint16_t color)
+{
+  if (!_bands) { _spr->fillSprite(color); return; }
+
+  _opCount  = 0;
+  _poolUsed = 0;
+  addOp(dlShape(DL_FILL_RECT, 0, 0, _w, _h, 0, color), false);
+}
+
+void ScreenCanvas::fillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color)
+{
+  if (!_bands) { _spr->fillRect(x, y, w, h, color); return; }
+  addOp(dlShape(DL_FILL_RECT, x, y, w, h, 0, color), true);
+}
+
+void ScreenCanvas::fillRoundRect(int32_t x, int32_t y, int32_t w, int32_t h, int32_t r, uint32_t color)
+{
+  if (!_bands) { _spr->fillRoundRect(x, y, w, h, r, color); return; }
+  addOp(dlShape(DL_FILL_RRECT, x, y, w, h, r, color), false);
+}
+
+void ScreenCanvas::drawRoundRect(int32_t x, int32_t y, int32_t w, int32_t h, int32_t r, uint32_t color)
+{
+  if (!_bands) { _spr->drawRoundRect(x, y, w, h, r, color); return; }
+  addOp(dlShape(DL_DRAW_RRECT, x, y, w, h, r, color), false);
+}
+
+void ScreenCanvas::drawLine(int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint32_t color)
+{
+  if (!_bands) { _spr->drawLine(x0, y0, x1, y1, color); return; }
+
+  DlOp op = dlShape(DL_LINE, x0, y0, x1, y1, 0, color);
+  op.box = dlBox(x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1);
+  addOp(op, false);
+}
+
+void ScreenCanvas::setTextFont(uint8_t font)
+{
+  _font = font;
+  if (!_bands) _spr->setTextFont(font);
+}
+
+void ScreenCanvas::setTextSize(uint8_t size)
+{
+  _size = size;
+  if (!_bands) _spr->setTextSize(size);
+}
+
+void ScreenCanvas::setTextDatum(uint8_t datum)
+{
+  _datum = datum;
+  if (!_bands) _spr->setTextDatum(datum);
+}
+
+void ScreenCanvas::setTextColor(uint16_t color)
+{
+  _fg = _bg = color;   // TFT_eSPI: arka plan = yazi rengi ise arka plan cizilmez
+  if (!_bands) _spr->setTextColor(color);
+}
+
+void ScreenCanvas::setTextColor(uint16_t color, uint16_t bg)
+{
+  _fg = color;
+  _bg = bg;
+  if (!_bands) _spr->setTextColor(color, bg);
+}
+
+int16_t ScreenCanvas::fontHeight()
+{
+  if (_bands) applyTextState();
+  return _spr->fontHeight();
+}
+
+int16_t ScreenCanvas::textWidth(const char *text)
+{
+  if (_bands) applyTextState();
+  return _spr->textWidth(text);
+}
+
+void ScreenCanvas::drawString(const char *text, int32_t x, int32_t y)
+{
+  if (!_bands) { _spr->drawString(text, x, y); return; }
+
+  DlOp op;
+  memset(&op, 0, sizeof(op));
+  op.kind  = DL_TEXT;
+  op.font  = _font;
+  op.size  = _size;
+  op.datum = _datum;
+  op.x     = x;
+  op.y     = y;
+  op.color = _fg;
+  op.bg    = _bg;
+  if (!addText(text, strlen(text), op.r)) {
+    if (_overflows++ == 0) Serial.println(F("UYARI: Ekran metin havuzu dolu, yazi atlandi."));
+    return;
+  }
+
+  // Datum'a gore kutu
+  int16_t w = textWidth(text);
+  int16_t h = _spr->fontHeight();
+  int32_t bx = x, by = y;
+  switch (_datum % 3) { case 1: bx -= w / 2; break; case 2: bx -= w; break; }
+  switch (_datum / 3) { case 1: by -= h / 2; break; case 2: by -= h; break; case 3: by -= h; break; }
+  op.box = dlBox(bx, by, w, h);
+  addOp(op, false);
+}
+
+// Listeyi eklenme sirasiyla [bandY, bandY + serit) araligina cizer. Secim
+// birkac piksel genis yapilir: yazi kutusu font olculerinden tahmindir.
+void ScreenCanvas::renderBand(TFT_eSprite &band, int16_t bandY)
+{
+  SprRect rowBox = dlBox(-2, bandY - 2, _w + 4, band.height() + 4);
+  band.fillSprite(TFT_BLACK);
+
+  for (uint16_t i = 0; i < _opCount; i++) {
+    const DlOp &o = _ops[i];
+    if (o.box.x0 >= rowBox.x1 || o.box.x1 <= rowBox.x0 ||
+        o.box.y0 >= rowBox.y1 || o.box.y1 <= rowBox.y0) continue;
+
+    switch (o.kind) {
+      case DL_FILL_RECT:  band.fillRect(o.x, o.y - bandY, o.w, o.h, o.color);            break;
+      case DL_FILL_RRECT: band.fillRoundRect(o.x, o.y - bandY, o.w, o.h, o.r, o.color);  break;
+      case DL_DRAW_RRECT: band.drawRoundRect(o.x, o.y - bandY, o.w, o.h, o.r, o.color);  break;
+      case DL_LINE:       band.drawLine(o.x, o.y - bandY, o.w, o.h - bandY, o.color);    break;
+      case DL_TEXT:
+        band.setTextFont(o.font);
+        band.setTextSize(o.size);
+        band.setTextDatum(o.datum);
+        band.setTextColor(o.color, o.bg);
+        band.drawString(&_pool[o.r], o.x, o.y - bandY);
+        break;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Ekran: kirli bolge takibi
+// -----------------------------------------------------------------------------
+bool sprRectsTouch(const SprRect &a, const SprRect &b)
+{
+  return a.x0 <= b.x1 && b.x0 <= a.x1 && a.y0 <= b.y1 && b.y0 <= a.y1;
+}
+
+SprRect sprRectUnion(const SprRect &a, const SprRect &b)
+{
+  SprRect u;
+  u.x0 = a.x0 < b.x0 ? a.x0 : b.x0;
+  u.y0 = a.y0 < b.y0 ? a.y0 : b.y0;
+  u.x1 = a.x1 > b.x1 ? a.x1 : b.x1;
+  u.y1 = a.y1 > b.y1 ? a.y1 : b.y1;
+  return u;
+}
+
+int32_t sprRectArea(const SprRect &a)
+{
+  return (int32_t)(a.x1 - a.x0) * (a.y1 - a.y0);
+}
+
+// Degen/kesisen dikdortgenler birlestirilir; liste dolarsa yeni bolge en az
+// buyume ile sigdigi dikdortgene katilir.
+void sprMarkDirty(int16_t x, int16_t y, int16_t w, int16_t h)
+{
+  SprRect n;
+  n.x0 = x < 0 ? 0 : x;
+  int16_t top = g_topBar.ownSprite ? TOP_BAR_H : 0;   // bar bolgesi sprTop'a ait
+  n.y0 = y < top ? top : y;
+  n.x1 = x + w > spr.width()  ? spr.width()  : x + w;
+  n.y1 = y + h > spr.height() ? spr.height() : y + h;
+  if (n.x0 >= n.x1 || n.y0 >= n.y1) return;
+
+  SprDirtyList &d = g_sprDirty;
+  for (uint8_t i = 0; i < d.count; ) {
+    if (sprRectsTouch(n, d.r[i])) {
+      n = sprRectUnion(n, d.r[i]);
+      d.r[i] = d.r[--d.count];
+      i = 0;   // buyuyen bolge oncekilere de degebilir
+    } else {
+      i++;
+    }
+  }
+
+  if (d.count == SPR_DIRTY_MAX) {
+    uint8_t best = 0;
+    int32_t bestGrow = INT32_MAX;
+    for (uint8_t i = 0; i < d.count; i++) {
+      int32_t grow = sprRectArea(sprRectUnion(n, d.r[i])) - sprRectArea(d.r[i]);
+      if (grow < bestGrow) { bestGrow = grow; best = i; }
+    }
+    d.r[best] = sprRectUnion(n, d.r[best]);
+    return;
+  }
+
+  d.r[d.count++] = n;
+}
+
+void sprClear(uint16_t color)
+{
+  spr.fillSprite(color);
+  g_sprDirty.count = 0;
+  sprMarkDirty(0, 0, spr.width(), spr.height());
+}
+
+void lcdInitDma()
+{
+  g_lcdDma.buf[0] = (uint16_t *)heap_caps_malloc(LCD_DMA_STRIP_PX * 2, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  g_lcdDma.buf[1] = (uint16_t *)heap_caps_malloc(LCD_DMA_STRIP_PX * 2, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  g_lcdDma.enabled = g_lcdDma.buf[0] && g_lcdDma.buf[1] && tft.initDMA();
+
+  if (g_lcdDma.enabled) {
+    Serial.printf("Ekran DMA: 2 x %u piksel serit tamponu\n", LCD_DMA_STRIP_PX);
+  } else {
+    free(g_lcdDma.buf[0]);
+    free(g_lcdDma.buf[1]);
+    g_lcdDma.buf[0] = g_lcdDma.buf[1] = nullptr;
+    Serial.println(F("UYARI: Ekran DMA kurulamadi, bloklayan gonderim kullanilacak."));
+  }
+}
+
+// Devam eden DMA'yi bitirir ve TFT'nin CS'ini birakir
+void lcdDmaWait()
+{
+  if (!g_lcdDma.inFlight) return;
+
+  uint32_t t0 = micros();
+  tft.dmaWait();
+  tft.endWrite();
+  g_lcdDma.inFlight = false;
+  g_lcdStats.waitUs += micros() - t0;
+}
+
+// src sprite'inin (sx, sy, w, h) bolgesini ekranda (dx, dy)'ye gonderir.
+// Sprite tamponu zaten SPI bayt sirasinda oldugu icin swap yapilmaz.
+void lcdPushRect(TFT_eSprite &src, int16_t sx, int16_t sy, int16_t w, int16_t h,
+                        int16_t dx, int16_t dy)
+{
+  if (w <= 0 || h <= 0) return;
+  g_lcdStats.pixels += (uint32_t)w * h;
+
+  if (!g_lcdDma.enabled) {
+    src.pushSprite(dx, dy, sx, sy, w, h);
+    return;
+  }
+
+  if (!g_lcdDma.inFlight) {
+    tft.startWrite();
+    g_lcdDma.inFlight = true;
+  }
+
+  const uint16_t *img = (const uint16_t *)src.getPointer();
+  int16_t srcW  = src.width();
+  int16_t lines = LCD_DMA_STRIP_PX / w;
+  if (lines < 1) lines = 1;
+
+  bool swap = tft.getSwapBytes();
+  tft.setSwapBytes(false);
+
+  for (int16_t row = 0; row < h; row += lines) {
+    int16_t n = (h - row < lines) ? (h - row) : lines;
+    uint16_t *dst = g_lcdDma.buf[g_lcdDma.next];
+    g_lcdDma.next ^= 1;
+
+    // Onceki serit hattayken bu serit kopyalanir; pushImageDMA kuyruga
+    // almadan once onceki seridin bitmesini bekler
+    for (int16_t r = 0; r < n; r++)
+      memcpy(&dst[r * w], &img[(sy + row + r) * srcW + sx], w * sizeof(uint16_t));
+    tft.pushImageDMA(dx, dy + row, w, n, dst);
+  }
+
+  tft.setSwapBytes(swap);
+}
+
+void sprPresent()
+{
+  uint32_t t0 = micros();
+
+  SprDirtyList &d = g_sprDirty;
+  for (uint8_t i = 0; i < d.count; i++) {
+    const SprRect &r = d.r[i];
+    int16_t w = r.x1 - r.x0;
+
+    if (!spr.banded()) {
+      lcdPushRect(g_frame, r.x0, r.y0, w, r.y1 - r.y0, r.x0, r.y0);
+      continue;
+    }
+
+    // Serit modu: bolge serit serit cizilip gonderilir. lcdPushRect seridi
+    // DMA tamponuna kopyaladigi icin serit sprite'i hemen yeniden kullanilir.
+    for (int16_t y = r.y0; y < r.y1; y += LCD_BAND_LINES) {
+      int16_t n = (r.y1 - y < LCD_BAND_LINES) ? (r.y1 - y) : LCD_BAND_LINES;
+      spr.renderBand(g_frame, y);
+      lcdPushRect(g_frame, r.x0, 0, w, n, r.x0, y);
+    }
+  }
+  d.count = 0;
+
+  if (g_topBar.pushPending) {
+    lcdPushRect(sprTop, 0, 0, sprTop.width(), TOP_BAR_H, 0, 0);
+    g_topBar.pushPending = false;
+  }
+
+  uint32_t dt = micros() - t0;
+  g_lcdStats.frames++;
+  g_lcdStats.presentUs += dt;
+  if (dt > g_lcdStats.maxPresentUs) g_lcdStats.maxPresentUs = dt;
+}
+
+void lcdPrintFrameStats()
+{
+  const LcdFrameStats &st = g_lcdStats;
+  uint32_t frames = st.frames ? st.frames : 1;
+  uint32_t wireUs = (uint32_t)((uint64_t)st.pixels * 16 * 1000000ULL / LCD_SPI_HZ);
+  uint32_t cpuUs  = st.presentUs + st.waitUs;
+
+  Serial.printf("Ekran: %lu kare (%s), ort %lu piksel\n",
+                (unsigned long)st.frames, g_lcdDma.enabled ? "DMA" : "bloklayan",
+                (unsigned long)(st.pixels / frames));
+  Serial.printf("  gonderim ort %lu us (max %lu), DMA bekleme toplam %lu us\n",
+                (unsigned long)(st.presentUs / frames), (unsigned long)st.maxPresentUs,
+                (unsigned long)st.waitUs);
+  Serial.printf("  SPI hat suresi %lu us, loop()'a kalan %ld us (%%%lu)\n",
+                (unsigned long)wireUs, (long)(wireUs - cpuUs),
+                (unsigned long)(wireUs > cpuUs ? (uint64_t)(wireUs - cpuUs) * 100 / wireUs : 0));
+}
+
+// -----------------------------------------------------------------------------
+// Top bar: baslik, wifi ikon, tarih/saat
+// -----------------------------------------------------------------------------
+const char* getScreenTitle(ScreenState s)
+{
+  switch (s)
+  {
+    case SCR_SETUP_MENU:            return "Ayarlar";
+    case SCR_WIFI_SETTINGS:         return "WiFi Ayarlari";
+    case SCR_PHONE_API:             return "Telefon / API";
+    case SCR_ADMIN_CARD:            return "Yonetici RFID";
+    case SCR_DRIVER_MENU:           return "RFID Ayarlari";
+    case SCR_DRIVER_CARD:           return "Yeni Sofor RFID/Plaka";
+    case SCR_DRIVER_LIST:           return "Kayitli RFID ve Plakalar";
+    case SCR_TEXT_INPUT:            return textInput.title.c_str();
+    case SCR_FACTORY_RESET_CONFIRM: return "Factory Reset";
+    case SCR_IDLE:                  return "Bekleme";
+    case SCR_FUELING:               return "Dolum";
+    case SCR_FUEL_SUMMARY:          return "Dolum Bitti";
+    case SCR_MESSAGE:               return infoMsg.title.c_str();
+    default:                        return "";
+  }
+}
+
+ScreenCanvas &topBarCanvas()
+{
+  return g_topBar.ownSprite ? g_topCanvas : spr;
+}
+
+// Akilli telefon tarzı "sebekes" ikon (dikey barlar)
+void drawWifiIcon(ScreenCanvas &dst, int16_t x, int16_t y, bool connected)
+{
+  uint16_t colOn  = connected ? TFT_GREEN    : TFT_DARKGREY;
+  uint16_t colOff = TFT_DARKGREY;
+
+  int baseY      = y + TOP_BAR_H - 3;  // alt hizası
+  int barW       = 3;
+  int gap        = 2;
+  int numBars    = 4;
+
+  for (int i = 0; i < numBars; i++)
+  {
+    int h   = 4 + i * 3;                // 4, 7, 10, 13 piksel
+    int bx  = x + i * (barW + gap);
+    uint16_t col = connected ? colOn : colOff;
+
+    dst.fillRect(bx, baseY - h, barW, h, col);
+  }
+}
+
+
+String getCurrentTimeString()
+{
+  time_t now;
+  struct tm ti;
+  time(&now);
+  localtime_r(&now, &ti);
+
+  int yearFull = ti.tm_year + 1900;
+  if (yearFull < 2020) {
+    return String("--:--:--");
+  }
+
+  int hh = ti.tm_hour;
+  int mm = ti.tm_min;
+  int ss = ti.tm_sec;
+
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%02d:%02d:%02d", hh, mm, ss);
+  return String(buf);
+}
+
+String getCurrentDateString()
+{
+  time_t now;
+  struct tm ti;
+  time(&now);
+  localtime_r(&now, &ti);
+
+  int yearFull = ti.tm_year + 1900;
+  if (yearFull < 2020) {
+    return String("--.--.--");
+  }
+
+  int dd = ti.tm_mday;
+  int mo = ti.tm_mon + 1;
+  int yy = yearFull % 100;
+
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%02d.%02d.%02d", dd, mo, yy);
+  return String(buf);
+}
+
+void drawTopBar(const char* title)
+{
+  ScreenCanvas &bar = topBarCanvas();
+  int16_t sw = bar.width();
+  bar.fillRect(0, 0, sw, TOP_BAR_H, TFT_BLUE);
+
+  bool wifiConnected = (WiFi.status() == WL_CONNECTED);
+  drawWifiIcon(bar, 2, 0, wifiConnected);
+
+  String dateStr = getCurrentDateString();
+  String timeStr = getCurrentTimeString();
+
+  bar.setTextFont(FONT_MAIN);
+  bar.setTextColor(TFT_WHITE, TFT_BLUE);
+
+  bar.setTextDatum(TR_DATUM);
+  bar.drawString(dateStr, sw - 4, 4);
+
+  bar.setTextDatum(BR_DATUM);
+  bar.drawString(timeStr, sw - 4, TOP_BAR_H - 2);
+
+  bar.setTextDatum(MC_DATUM);
+  bar.drawString(title, sw / 2, TOP_BAR_H / 2 + 2);
+
+  g_topBar.drawn = true;
+  g_topBar.wifi  = wifiConnected;
+  g_topBar.title = title;
+  g_topBar.date  = dateStr;
+  g_topBar.time  = timeStr;
+
+  if (g_topBar.ownSprite) g_topBar.pushPending = true;
+  else                    sprMarkDirty(0, 0, sw, TOP_BAR_H);
+}
+
+// Sag hizali sabit genislikli (FONT_MAIN) metinde sadece degisen karakter
+// hucreleri yeniden cizilir ve sadece ilk-son degisen arasi gonderilir.
+// Uzunluk degistiyse false doner, bar tam cizilmeli.
+bool topBarUpdateText(String &shown, const String &now, int16_t right, int16_t top)
+{
+  if (now.length() != shown.length()) return false;
+
+  ScreenCanvas &bar = g_topCanvas;
+  bar.setTextFont(FONT_MAIN);
+  bar.setTextColor(TFT_WHITE, TFT_BLUE);
+  bar.setTextDatum(TL_DATUM);
+
+  int16_t cw = bar.textWidth("0");
+  int16_t ch = bar.fontHeight();
+  int16_t x0 = right - cw * (int16_t)now.length();
+  int first = -1, last = -1;
+
+  for (unsigned i = 0; i < now.length(); i++) {
+    if (now[i] == shown[i]) continue;
+
+    char c[2] = { now[i], 0 };
+    bar.fillRect(x0 + i * cw, top, cw, ch, TFT_BLUE);
+    bar.drawString(c, x0 + i * cw, top);
+    if (first < 0) first = i;
+    last = i;
+  }
+  shown = now;
+
+  if (first >= 0) {
+    uint32_t t0 = micros();
+    int16_t x = x0 + first * cw;
+    lcdPushRect(sprTop, x, top, (last - first + 1) * cw, ch, x, top);
+    g_lcdStats.frames++;
+    g_lcdStats.presentUs += micros() - t0;
+  }
+  return true;
+}
+
+// loop() saniyede bir cagirir. Baslik veya WiFi durumu degismediyse sadece
+// saat (ve gun donumunde tarih) karakterleri guncellenir.
+void updateTopBarForCurrentScreen()
+{
+  const char* title = getScreenTitle(currentScreen);
+  bool wifiConnected = (WiFi.status() == WL_CONNECTED);
+
+  if (g_topBar.ownSprite && g_topBar.drawn &&
+      g_topBar.wifi == wifiConnected && g_topBar.title == title) {
+    int16_t right = sprTop.width() - 4;
+    sprTop.setTextFont(FONT_MAIN);
+    int16_t ch = sprTop.fontHeight();
+
+    if (topBarUpdateText(g_topBar.date, getCurrentDateString(), right, 4) &&
+        topBarUpdateText(g_topBar.time, getCurrentTimeString(), right, TOP_BAR_H - 2 - ch))
+      return;
+  }
+
+  drawTopBar(title);
+  sprPresent();
+}
+
+// -----------------------------------------------------------------------------
+// WiFi + NTP yönetimi
+// -----------------------------------------------------------------------------
+void handleWifiAndTime()
+{
+  // Artık burada otomatik WiFi baglanti denemiyoruz.
+  // Sadece baglanti kurulmus ise NTP zamanini ayarliyoruz.
+  if (WiFi.status() == WL_CONNECTED && !timeConfigured)
+  {
+    Serial.print(F("WiFi baglandi. IP: "));
+    Serial.println(WiFi.localIP());
+    Serial.println(F("NTP ayarlaniyor..."));
+    configTime(GMT_OFFSET_SEC, DAYLIGHT_OFFSET_SEC, NTP_SERVER);
+    timeConfigured = true;
+  }
+}
+
+// WiFi: bloklu baglanma denemesi
+bool wifiAttemptConnectBlocking(const String &ssid, const String &password)
+{
+  Serial.printf("WiFi baglantisi (bloklu) deneniyor: %s\n", ssid.c_str());
+
+  WiFi.mode(WIFI_STA);
+  WiFi.disconnect(true, true);
+  delay(100);
+  WiFi.begin(ssid.c_str(), password.c_str());
+
+  unsigned long start = millis();
+  const unsigned long timeout = 15000; // 15 saniye
+
+  while (WiFi.status() != WL_CONNECTED && (millis() - start) < timeout)
+  {
+    delay(200);
+  }
+
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    Serial.print(F("WiFi baglandi. IP: "));
+    Serial.println(WiFi.localIP());
+    wifiClientStarted = true;
+    timeConfigured    = false;
+    return true;
+  }
+  else
+  {
+    Serial.println(F("WiFi baglanamadi (timeout veya hata)."));
+    wifiClientStarted = false;
+    return false;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// RS485 / Modbus Fonksiyonlari
+// -----------------------------------------------------------------------------
+// UART2 IDF surucusu ile: RTS pini DE/RE'yi surer, son stop bitinden hemen
+// sonra alima doner. TX FIFO'ya yazilip birakilir, CPU gonderimi beklemez.
+// RX verisi FIFO esiginde veya RS485_RX_TOUT_SYMS karakter sessizlikte
+// olay kuyruguna duser; RS485 gorevi bu kuyrukta uyur.
+void initRs485()
+{
+  uart_config_t cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.baud_rate  = RS485_DEFAULT_BAUD;
+  cfg.data_bits  = UART_DATA_8_BITS;
+  cfg.parity     = UART_PARITY_DISABLE;
+  cfg.stop_bits  = UART_STOP_BITS_1;
+  cfg.flow_ctrl  = UART_HW_FLOWCTRL_DISABLE;
+  cfg.source_clk = UART_SCLK_APB;
+
+  esp_err_t err = uart_driver_install(RS485_UART, RS485_RX_BUF_SIZE, 0,
+                                      RS485_EVT_QUEUE_LEN, &g_rs485UartQueue, 0);
+  if (err == ESP_OK) err = uart_param_config(RS485_UART, &cfg);
+  if (err == ESP_OK) err = uart_set_pin(RS485_UART, RS485_TX_PIN, RS485_RX_PIN,
+                                        RS485_REDE_PIN, UART_PIN_NO_CHANGE);
+  if (err == ESP_OK) err = uart_set_mode(RS485_UART, UART_MODE_RS485_HALF_DUPLEX);
+  if (err == ESP_OK) err = uart_set_rx_timeout(RS485_UART, RS485_RX_TOUT_SYMS);
+  if (err != ESP_OK) {
+    Serial.printf("HATA: RS485 UART kurulamadi (%d)\n", (int)err);
+    return;
+  }
+
+  g_rs485Baud = RS485_DEFAULT_BAUD;
+  rs485SetBaud(RS485_DEFAULT_BAUD);
+  Serial.printf("RS485 baslatildi (UART2, half-duplex, %lu 8N1).\n", (unsigned long)g_rs485Baud);
+
+  for (uint8_t i = 0; i < METER_COUNT; i++) {
+    Meter &m = g_meters[i];
+    memset(&m, 0, sizeof(Meter));
+    m.slaveAddr = METER_CONFIG[i].slaveAddr;
+    m.model     = METER_CONFIG[i].model;
+    meterPlanReads(*m.model->map, METER_FIELDS_FUELING, m.plan);
+
+    uint16_t regCount = 0;
+    for (uint8_t r = 0; r < m.plan.count; r++) regCount += m.plan.reads[r].qty;
+    Serial.printf("Sayac %u (%s): poll = %u okuma, %u register\n",
+                  m.slaveAddr, m.model->name, m.plan.count, regCount);
+  }
+  Serial.printf("RS485: %u sayac tanimli\n", METER_COUNT);
+
+  mbCapInit();
+
+#ifdef MODBUS_SIM
+  mbSimInit();
+#endif
+
+  if (RS485_AUTO_BAUD_PROBE) rs485ProbeBaud();
+
+#ifdef MODBUS_SIM
+  mbSimBenchmark();
+#endif
+
+  rs485StartTask();
+}
+
+// Hizi degistirir ve Modbus zamanlamasini yeniden hesaplar.
+// 19200 ustunde t3.5 spesifikasyona gore sabit 1750 us'dir.
+void rs485SetBaud(uint32_t baud)
+{
+  if (baud != g_rs485Baud) uart_set_baudrate(RS485_UART, baud);
+
+  g_rs485Baud = baud;
+  g_mbCharUs  = (MB_BITS_PER_CHAR * 1000000UL + baud - 1) / baud;
+  g_mbT35Us   = (baud > 19200) ? 1750 : (g_mbCharUs * 7 + 1) / 2;
+}
+
+// Sayacin kabul ettigi en yuksek hizi bulur: hizlari buyukten kucuge dener,
+// ilk sayactan tek register okumasi basarili olan hizda kalir. Sadece
+// setup() sirasinda calisir, bu yuzden cevabi bloklayarak bekler.
+void rs485ProbeBaud()
+{
+  const uint8_t n = sizeof(RS485_PROBE_BAUDS) / sizeof(RS485_PROBE_BAUDS[0]);
+
+  for (uint8_t i = 0; i < n; i++) {
+    rs485SetBaud(RS485_PROBE_BAUDS[i]);
+    delay(5);   // onceki hizdaki cop icin sayacin cerceve sonunu gormesi
+
+    if (!meterProbe(g_meters[0], nullptr))
+      continue;
+    while (mbBusy()) {
+      mbPoll();
+      delay(1);
+    }
+
+    if (g_mb.result == MB_RESULT_OK) {
+      Serial.printf("RS485: sayac %lu baud'da cevap verdi (t3.5 = %lu us)\n",
+                    (unsigned long)g_rs485Baud, (unsigned long)g_mbT35Us);
+      return;
+    }
+  }
+
+  rs485SetBaud(RS485_DEFAULT_BAUD);
+  Serial.println(F("RS485: hiz taramasinda cevap yok, 19200 kullaniliyor."));
+}
+
+void rs485StartTask()
+{
+  g_meterCmdQueue = xQueueCreate(4, sizeof(MeterCmd));
+
+  BaseType_t ok = xTaskCreatePinnedToCore(rs485Task, "rs485", RS485_TASK_STACK, nullptr,
+                                          RS485_TASK_PRIO, &g_rs485Task, RS485_TASK_CORE);
+  if (ok != pdPASS || !g_meterCmdQueue) {
+    Serial.println(F("HATA: RS485 gorevi olusturulamadi!"));
+    return;
+  }
+  Serial.printf("RS485 gorevi core %d'de basladi\n", (int)RS485_TASK_CORE);
+}
+
+// Modbus master dongusu. UART olay kuyrugunda en fazla 1 tick (1 ms) uyur:
+// cevap gelince hemen uyanir, bos zamanda diger core 0 gorevlerine
+// (WiFi, idle/WDT) yer birakir.
+void rs485Task(void *arg)
+{
+  (void)arg;
+  for (;;)
+  {
+    rs485HandleCommands();
+    meterPublishPending();
+
+    mbPoll();
+    handleSessionStart();
+    handleMeterPolling();
+
+    rs485WaitForEvent();
+  }
+}
+
+void rs485HandleCommands()
+{
+  // Bir baslatma bitmeden yenisi alinmaz; komut kuyrukta bekler
+  if (g_sessionStartPhase != SSP_NONE || g_sessionStartResultPending) return;
+
+  MeterCmd cmd;
+  if (xQueueReceive(g_meterCmdQueue, &cmd, 0) != pdTRUE) return;
+
+  if (cmd.kind == METER_CMD_START_SESSION && cmd.meterIdx < METER_COUNT)
+  {
+    // Bus bosalinca handleSessionStart() CONTROL_CMD'yi gonderir
+    g_sessionStartMeter = cmd.meterIdx;
+    g_sessionStartPhase = SSP_QUEUED;
+  }
+}
+
+bool meterEvtPush(const MeterEvent &e)
+{
+  uint32_t head = g_meterEvents.head.load(std::memory_order_relaxed);
+  uint32_t tail = g_meterEvents.tail.load(std::memory_order_acquire);
+  if (head - tail >= METER_EVT_RING_SIZE) {
+    g_meterEvents.drops++;
+    return false;
+  }
+
+  g_meterEvents.buf[head & (METER_EVT_RING_SIZE - 1)] = e;
+  g_meterEvents.head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+bool meterEvtPop(MeterEvent &e)
+{
+  uint32_t tail = g_meterEvents.tail.load(std::memory_order_relaxed);
+  uint32_t head = g_meterEvents.head.load(std::memory_order_acquire);
+  if (tail == head) return false;
+
+  e = g_meterEvents.buf[tail & (METER_EVT_RING_SIZE - 1)];
+  g_meterEvents.tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+// Sayacin son durumunu UI'a yayinlar; kuyruk doluysa sonra tekrar denenir
+void meterPublish(uint8_t idx)
+{
+  Meter &m = g_meters[idx];
+
+  MeterEvent e;
+  e.kind          = METER_EVT_SAMPLE;
+  e.meterIdx      = idx;
+  e.sessionActive = m.sessionActive;
+  e.data          = m.data;
+  e.sampleMs      = m.sampleMs;
+
+  m.publishPending = !meterEvtPush(e);
+}
+
+void meterPublishPending()
+{
+  if (g_sessionStartResultPending)
+    g_sessionStartResultPending = !meterEvtPush(g_sessionStartResult);
+
+  for (uint8_t i = 0; i < METER_COUNT; i++)
+    if (g_meters[i].publishPending) meterPublish(i);
+}
+
+// UART olayini bekler (en fazla 1 tick). Veri olaylari sadece gorevi
+// uyandirir, okumayi mbPoll() yapar; tasma/hat hatalari sayilir.
+void rs485WaitForEvent()
+{
+#ifdef MODBUS_SIM
+  vTaskDelay(1);
+  return;
+#endif
+
+  uart_event_t ev;
+  if (xQueueReceive(g_rs485UartQueue, &ev, 1) != pdTRUE) return;
+
+  switch (ev.type) {
+    case UART_FIFO_OVF:
+    case UART_BUFFER_FULL:
+      // Yarim cerceve ise yaramaz: at, islem timeout + RESYNC ile toparlanir
+      g_rs485RxOverflows++;
+      uart_flush_input(RS485_UART);
+      xQueueReset(g_rs485UartQueue);
+      break;
+
+    case UART_FRAME_ERR:
+    case UART_PARITY_ERR:
+      g_rs485RxLineErrors++;
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Tasima katmani: Modbus motoru hatta sadece bu dort fonksiyonla erisir.
+// -DMODBUS_SIM ile derlenince UART yerine sayac simulatoru baglanir.
+#ifndef MODBUS_SIM
+
+void rs485TxFrame(const uint8_t *frame, uint8_t len)
+{
+  // TX FIFO'ya kopyalanip donulur; DE/RE'yi donanim surer
+  uart_write_bytes(RS485_UART, (const char *)frame, len);
+}
+
+size_t rs485RxAvailable()
+{
+  size_t avail = 0;
+  uart_get_buffered_data_len(RS485_UART, &avail);
+  return avail;
+}
+
+int rs485RxRead(uint8_t *buf, size_t len)
+{
+  return uart_read_bytes(RS485_UART, buf, len, 0);
+}
+
+void rs485RxFlush()
+{
+  uart_flush_input(RS485_UART);
+  xQueueReset(g_rs485UartQueue);
+}
+
+#else
+
+// -----------------------------------------------------------------------------
+// Sayac simulatoru (-DMODBUS_SIM)
+// Gercek dispenser olmadan master kodunu (cerceve, parser, zamanlayici,
+// poll/baslatma akislari) calistirir. Standart register haritasini
+// (METER_MAP_STD) taklit eder; cevap baytlari ayarli baud'da hattan
+// geliyormus gibi zamanlanir. Acilista mbSimBenchmark() calisir, sonra
+// uygulama simulatorle normal sekilde calisir.
+// -----------------------------------------------------------------------------
+
+// Akis profili: dolum basladiktan sonra sirayla uygulanan debi adimlari.
+// Profil bitince simulator oturumu kapatir.
+struct MbSimFlowStep
+{
+  uint32_t durationMs;
+  uint16_t flowClm;
+};
+
+const MbSimFlowStep MB_SIM_FLOW_PROFILE[] = {
+  {  2000, 1500 },   // yavas baslangic
+  { 20000, 4000 },   // tam debi
+  {  3000,  800 },   // sona dogru kisma
+  {  2000,    0 },   // tabanca kapali
+};
+
+// Hata enjeksiyonu: 0 = kapali, N = her N istekten birinde
+struct MbSimScript
+{
+  uint32_t replyDelayUs;     // slave turnaround
+  uint16_t crcErrorEvery;    // cevabin son bayti bozulur
+  uint16_t exceptionEvery;   // DEVICE_BUSY exception
+  uint16_t silentEvery;      // cevap yok (timeout)
+};
+
+const MbSimScript MB_SIM_SCRIPT_CLEAN = { 1500, 0, 0, 0 };
+const MbSimScript MB_SIM_SCRIPT_NOISY = { 3000, 50, 40, 100 };
+const MbSimScript MB_SIM_SCRIPT_APP   = MB_SIM_SCRIPT_NOISY;   // benchmark sonrasi
+
+#define MB_SIM_BENCH_COUNT 200
+
+struct MbSim
+{
+  MbSimScript script;
+  uint16_t    regs[METER_REG_IMAGE];   // adres 0'dan itibaren
+  bool        sessionActive;
+  uint32_t    sessionStartMs;
+  uint32_t    lastUpdateMs;
+  uint32_t    volRemainder;            // cl * ms / dk kalan
+  uint32_t    sessionVolCl;
+  uint32_t    totalVolCl;
+  uint16_t    flowClm;
+  uint32_t    requests;
+  uint8_t     resp[5 + 2 * MB_MAX_READ_REGS];
+  uint8_t     respLen;
+  uint8_t     respPos;
+  uint32_t    respStartUs;             // ilk baytin hatta cikmaya basladigi an
+};
+
+MbSim g_mbSim;
+
+void mbSimInit()
+{
+  memset(&g_mbSim, 0, sizeof(g_mbSim));
+  g_mbSim.script     = MB_SIM_SCRIPT_CLEAN;
+  g_mbSim.totalVolCl = 1234567;
+  g_mbSim.lastUpdateMs = millis();
+  mbSimUpdate();
+  Serial.println(F("RS485: SIMULATOR modu, UART kullanilmiyor."));
+}
+
+// Debi profilini zamana gore ilerletir, register'lari gunceller
+void mbSimUpdate()
+{
+  MbSim &sim = g_mbSim;
+  uint32_t now = millis();
+  uint32_t dt  = now - sim.lastUpdateMs;
+  sim.lastUpdateMs = now;
+
+  if (sim.sessionActive) {
+    uint32_t elapsed = now - sim.sessionStartMs;
+    uint16_t flow = 0;
+    bool inProfile = false;
+    for (uint8_t i = 0; i < sizeof(MB_SIM_FLOW_PROFILE) / sizeof(MB_SIM_FLOW_PROFILE[0]); i++) {
+      if (elapsed < MB_SIM_FLOW_PROFILE[i].durationMs) {
+        flow = MB_SIM_FLOW_PROFILE[i].flowClm;
+        inProfile = true;
+        break;
+      }
+      elapsed -= MB_SIM_FLOW_PROFILE[i].durationMs;
+    }
+
+    sim.volRemainder += (uint32_t)sim.flowClm * dt;
+    uint32_t dVol = sim.volRemainder / 60000UL;
+    sim.volRemainder -= dVol * 60000UL;
+    sim.sessionVolCl += dVol;
+    sim.totalVolCl   += dVol;
+
+    sim.flowClm = flow;
+    if (!inProfile) {
+      sim.sessionActive = false;
+      sim.flowClm = 0;
+    }
+  }
+
+  uint16_t status = STATUS_READY_BIT;
+  if (sim.sessionActive) status |= STATUS_SESSION_ACTIVE_BIT;
+  if (sim.flowClm > 0)   status |= STATUS_FLOW_ACTIVE_BIT;
+
+  sim.regs[REG_STATUS_FLAGS]  = status;
+  sim.regs[REG_SESSION_VOL_H] = (uint16_t)(sim.sessionVolCl >> 16);
+  sim.regs[REG_SESSION_VOL_L] = (uint16_t)(sim.sessionVolCl & 0xFFFF);
+  sim.regs[REG_TOTAL_VOL_H]   = (uint16_t)(sim.totalVolCl >> 16);
+  sim.regs[REG_TOTAL_VOL_L]   = (uint16_t)(sim.totalVolCl & 0xFFFF);
+  sim.regs[REG_FLOW_RATE]     = sim.flowClm;
+}
+
+bool mbSimEvery(uint16_t n)
+{
+  return n != 0 && (g_mbSim.requests % n) == 0;
+}
+
+// Cevap CRC'si eklenip zamanlanir: istek cercevesinin hattaki suresi +
+// turnaround sonra baytlar birer karakter suresi arayla "gelir"
+void mbSimReply(const uint8_t *pdu, uint8_t pduLen)
+{
+  MbSim &sim = g_mbSim;
+  memcpy(sim.resp, pdu, pduLen);
+  uint16_t crc = modbusCRC16(sim.resp, pduLen);
+  sim.resp[pduLen]     = (uint8_t)(crc & 0xFF);
+  sim.resp[pduLen + 1] = (uint8_t)(crc >> 8);
+  if (mbSimEvery(sim.script.crcErrorEvery)) sim.resp[pduLen + 1] ^= 0x5A;
+
+  sim.respLen     = pduLen + 2;
+  sim.respPos     = 0;
+  sim.respStartUs = micros() + g_mb.txLen * g_mbCharUs + sim.script.replyDelayUs;
+}
+
+void mbSimHandleRequest(const uint8_t *frame, uint8_t len)
+{
+  MbSim &sim = g_mbSim;
+  sim.requests++;
+  sim.respLen = sim.respPos = 0;
+
+  if (len < 4 || modbusCRC16(frame, len) != 0) return;   // bozuk istege cevap yok
+
+  bool known = false;
+  for (uint8_t i = 0; i < METER_COUNT; i++)
+    if (METER_CONFIG[i].slaveAddr == frame[0]) known = true;
+  if (!known) return;
+
+  if (mbSimEvery(sim.script.silentEvery)) return;
+
+  mbSimUpdate();
+
+  uint8_t pdu[5 + 2 * MB_MAX_READ_REGS];
+  pdu[0] = frame[0];
+  pdu[1] = frame[1];
+
+  if (mbSimEvery(sim.script.exceptionEvery)) {
+    pdu[1] |= MB_EXCEPTION_BIT;
+    pdu[2]  = MB_EX_DEVICE_BUSY;
+    mbSimReply(pdu, 3);
+    return;
+  }
+
+  uint8_t  fc    = frame[1];
+  uint16_t addr  = ((uint16_t)frame[2] << 8) | frame[3];
+  uint16_t value = ((uint16_t)frame[4] << 8) | frame[5];
+
+  // Yazma (FC06 / FC17'nin yazma kismi): CONTROL_CMD=1 dolumu baslatir
+  uint16_t wAddr = 0, wValue = 0;
+  bool write = false;
+  if (fc == MB_FC_WRITE_SINGLE_REG) {
+    wAddr = addr; wValue = value; write = true;
+  } else if (fc == MB_FC_READ_WRITE_MULTI && len >= 13) {
+    wAddr  = ((uint16_t)frame[6] << 8) | frame[7];
+    wValue = ((uint16_t)frame[11] << 8) | frame[12];
+    write  = true;
+  }
+  if (write) {
+    if (wAddr >= METER_REG_IMAGE) {
+      pdu[1] |= MB_EXCEPTION_BIT;
+      pdu[2]  = MB_EX_ILLEGAL_ADDRESS;
+      mbSimReply(pdu, 3);
+      return;
+    }
+    if (wAddr == REG_CONTROL_CMD && wValue == 1) {
+      sim.sessionActive  = true;
+      sim.sessionStartMs = millis();
+      sim.sessionVolCl   = 0;
+      sim.volRemainder   = 0;
+      mbSimUpdate();
+    }
+  }
+
+  if (fc == MB_FC_WRITE_SINGLE_REG) {
+    mbSimReply(frame, 6);   // echo
+    return;
+  }
+
+  if (fc != MB_FC_READ_HOLDING && fc != MB_FC_READ_WRITE_MULTI) {
+    pdu[1] |= MB_EXCEPTION_BIT;
+    pdu[2]  = MB_EX_ILLEGAL_FUNCTION;
+    mbSimReply(pdu, 3);
+    return;
+  }
+
+  uint16_t qty = value;
+  if (qty == 0 || qty > MB_MAX_READ_REGS || addr + qty > METER_REG_IMAGE) {
+    pdu[1] |= MB_EXCEPTION_BIT;
+    pdu[2]  = MB_EX_ILLEGAL_ADDRESS;
+    mbSimReply(pdu, 3);
+    return;
+  }
+
+  pdu[2] = (uint8_t)(qty * 2);
+  for (uint16_t i = 0; i < qty; i++) {
+    pdu[3 + 2 * i]     = (uint8_t)(sim.regs[addr + i] >> 8);
+    pdu[3 + 2 * i + 1] = (uint8_t)(sim.regs[addr + i] & 0xFF);
+  }
+  mbSimReply(pdu, 3 + 2 * qty);
+}
+
+void rs485TxFrame(const uint8_t *frame, uint8_t len)
+{
+  mbSimHandleRequest(frame, len);
+}
+
+size_t rs485RxAvailable()
+{
+  const MbSim &sim = g_mbSim;
+  if (sim.respPos >= sim.respLen) return 0;
+
+  int32_t elapsed = (int32_t)(micros() - sim.respStartUs);
+  if (elapsed < 0) return 0;
+
+  uint32_t arrived = (uint32_t)elapsed / g_mbCharUs;
+  if (arrived > sim.respLen) arrived = sim.respLen;
+  return arrived > sim.respPos ? arrived - sim.respPos : 0;
+}
+
+int rs485RxRead(uint8_t *buf, size_t len)
+{
+  size_t n = rs485RxAvailable();
+  if (n > len) n = len;
+  memcpy(buf, &g_mbSim.resp[g_mbSim.respPos], n);
+  g_mbSim.respPos += n;
+  return (int)n;
+}
+
+void rs485RxFlush()
+{
+  // Sadece hattan gelmis baytlar atilir, yoldaki baytlar yine gelir
+  g_mbSim.respPos += rs485RxAvailable();
+}
+
+int mbSimCmpU32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Her fonksiyon kodu icin MB_SIM_BENCH_COUNT islem: islem/s (t3.5 bekleme
+// dahil) ve p50/p99 tur suresi (istek gonderimi -> cevabin son bayti).
+// Once temiz hatta, sonra hata enjeksiyonlu hatta calisir.
+void mbSimBenchmark()
+{
+  static uint32_t rtt[MB_SIM_BENCH_COUNT];
+  uint16_t regs[6];
+  const uint16_t cmd = 0;   // etkisiz komut: oturumu baslatmaz
+  const uint8_t  slave = METER_CONFIG[0].slaveAddr;
+  const uint8_t  fcs[3] = { MB_FC_READ_HOLDING, MB_FC_WRITE_SINGLE_REG, MB_FC_READ_WRITE_MULTI };
+  const MbSimScript *scripts[2] = { &MB_SIM_SCRIPT_CLEAN, &MB_SIM_SCRIPT_NOISY };
+
+  Serial.printf("Modbus sim bench: %lu baud, t3.5 = %lu us\n",
+                (unsigned long)g_rs485Baud, (unsigned long)g_mbT35Us);
+
+  for (uint8_t s = 0; s < 2; s++) {
+    g_mbSim.script = *scripts[s];
+
+    for (uint8_t f = 0; f < 3; f++) {
+      uint16_t ok = 0, fail = 0;
+      uint32_t t0 = micros();
+
+      for (uint16_t i = 0; i < MB_SIM_BENCH_COUNT; i++) {
+        while (!mbReady()) mbPoll();
+
+        bool sent;
+        if (fcs[f] == MB_FC_READ_HOLDING)
+          sent = modbusReadHoldingRegisters(slave, REG_STATUS_FLAGS, 6, regs, nullptr);
+        else if (fcs[f] == MB_FC_WRITE_SINGLE_REG)
+          sent = modbusWriteSingleRegister(slave, REG_CONTROL_CMD, cmd, nullptr);
+        else
+          sent = modbusReadWriteRegisters(slave, REG_STATUS_FLAGS, 6, regs,
+                                          REG_CONTROL_CMD, &cmd, 1, nullptr);
+        if (!sent) { fail++; continue; }
+
+        while (mbBusy()) mbPoll();
+
+        if (g_mb.result == MB_RESULT_OK) rtt[ok++] = g_mbLastFrameEndUs - g_mb.submitUs;
+        else fail++;
+      }
+
+      uint32_t elapsedUs = micros() - t0;
+      qsort(rtt, ok, sizeof(rtt[0]), mbSimCmpU32);
+
+      Serial.printf("  %s FC%02X: %.1f islem/s, p50 %lu us, p99 %lu us, hata %u/%u\n",
+                    s == 0 ? "temiz" : "hatali", fcs[f],
+                    elapsedUs ? MB_SIM_BENCH_COUNT * 1e6f / elapsedUs : 0.0f,
+                    (unsigned long)(ok ? rtt[(ok - 1) * 50 / 100] : 0),
+                    (unsigned long)(ok ? rtt[(ok - 1) * 99 / 100] : 0),
+                    fail, MB_SIM_BENCH_COUNT);
+    }
+  }
+
+  g_mbSim.script = MB_SIM_SCRIPT_APP;
+}
+
+#endif // MODBUS_SIM
+
+// CRC-16/Modbus tablosu derleme zamaninda uretilir (flash'ta, 512 bayt).
+// Her eleman, eski bit-bit dongunun tek bayt icin 8 adiminin sonucudur.
+constexpr uint16_t mbCrcStep(uint16_t crc, uint8_t bits)
+{
+  return bits == 0 ? crc
+                   : mbCrcStep((crc & 0x0001) ? (uint16_t)((crc >> 1) ^ 0xA001)
+                                              : (uint16_t)(crc >> 1),
+                               (uint8_t)(bits - 1));
+}
+
+#define MB_CRC_T1(i)   mbCrcStep((uint16_t)(i), 8)
+#define MB_CRC_T4(i)   MB_CRC_T1(i), MB_CRC_T1((i) + 1), MB_CRC_T1((i) + 2), MB_CRC_T1((i) + 3)
+#define MB_CRC_T16(i)  MB_CRC_T4(i), MB_CRC_T4((i) + 4), MB_CRC_T4((i) + 8), MB_CRC_T4((i) + 12)
+#define MB_CRC_T64(i)  MB_CRC_T16(i), MB_CRC_T16((i) + 16), MB_CRC_T16((i) + 32), MB_CRC_T16((i) + 48)
+
+constexpr uint16_t MB_CRC_TABLE[256] = {
+  MB_CRC_T64(0), MB_CRC_T64(64), MB_CRC_T64(128), MB_CRC_T64(192)
+};
+
+static_assert(MB_CRC_TABLE[1] == 0xC0C1 && MB_CRC_TABLE[128] == 0xA001 && MB_CRC_TABLE[255] == 0x4040,
+              "CRC-16/Modbus tablosu hatali");
+
+inline uint16_t modbusCRC16Update(uint16_t crc, uint8_t b)
+{
+  return (crc >> 8) ^ MB_CRC_TABLE[(crc ^ b) & 0xFF];
+}
+
+uint16_t modbusCRC16(const uint8_t *data, uint16_t length)
+{
+  uint16_t crc = 0xFFFF;
+  for (uint16_t pos = 0; pos < length; pos++) {
+    crc = modbusCRC16Update(crc, data[pos]);
+  }
+  return crc;
+}
+
+#ifdef MODBUS_CRC_BENCH
+// Referans: eski bit-bit CRC (sadece karsilastirma / benchmark icin)
+uint16_t modbusCRC16Bitwise(const uint8_t *data, uint16_t length)
+{
+  uint16_t crc = 0xFFFF;
+  for (uint16_t pos = 0; pos < length; pos++) {
+    crc ^= (uint16_t)data[pos];
+    for (uint8_t i = 0; i < 8; i++) {
+      if (crc & 0x0001) {
+        crc >>= 1;
+        crc ^= 0xA001;
+      } else {
+        crc >>= 1;
+      }
+    }
+  }
+  return crc;
+}
+
+// -DMODBUS_CRC_BENCH ile derlenirse setup() sonunda calisir:
+// once iki fonksiyonun ayni sonucu verdigini dogrular, sonra 8 bayt (istek)
+// ve 17 bayt (6 register cevabi) cerceveler icin ns/bayt olcer.
+void modbusCrcBenchmark()
+{
+  uint8_t buf[64];
+  uint32_t seed = 0x12345678;
+  for (uint16_t n = 0; n < 2000; n++) {
+    uint16_t len = n % sizeof(buf);
+    for (uint16_t i = 0; i < len; i++) {
+      seed = seed * 1103515245UL + 12345UL;
+      buf[i] = (uint8_t)(seed >> 16);
+    }
+    if (modbusCRC16(buf, len) != modbusCRC16Bitwise(buf, len)) {
+      Serial.printf("CRC bench: FARK! len=%u\n", len);
+      return;
+    }
+  }
+  Serial.println(F("CRC bench: tablo == bit-bit (2000 rastgele cerceve)"));
+
+  const uint16_t frameLens[2] = { 8, 17 };
+  const uint32_t ITER = 20000;
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  volatile uint16_t sink = 0;
+
+  for (uint8_t f = 0; f < 2; f++) {
+    uint16_t len = frameLens[f];
+
+    uint32_t c0 = ESP.getCycleCount();
+    for (uint32_t i = 0; i < ITER; i++) sink ^= modbusCRC16Bitwise(buf, len);
+    uint32_t c1 = ESP.getCycleCount();
+    for (uint32_t i = 0; i < ITER; i++) sink ^= modbusCRC16(buf, len);
+    uint32_t c2 = ESP.getCycleCount();
+
+    float nsBit = (float)(c1 - c0) * 1000.0f / mhz / (ITER * len);
+    float nsTab = (float)(c2 - c1) * 1000.0f / mhz / (ITER * len);
+    Serial.printf("CRC bench %2u bayt: bit-bit %.1f ns/bayt, tablo %.1f ns/bayt (x%.1f)\n",
+                  len, nsBit, nsTab, nsBit / nsTab);
+  }
+  (void)sink;
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// Modbus trafik kaydi
+// -----------------------------------------------------------------------------
+void mbCapInit()
+{
+  g_mbCap.written.store(0);
+  g_mbCap.rxOpen = false;
+  g_mbCap.slots  = nullptr;
+
+  if (psramFound())
+    g_mbCap.slots = (MbCapRecord *)ps_malloc(MB_CAP_SLOTS * sizeof(MbCapRecord));
+
+  if (g_mbCap.slots)
+    Serial.printf("Modbus kaydi: %u kayit (%u KB PSRAM), seri konsolda 'm' ile aktarilir\n",
+                  MB_CAP_SLOTS, (unsigned)(MB_CAP_SLOTS * sizeof(MbCapRecord) / 1024));
+  else
+    Serial.println(F("UYARI: Modbus kaydi icin PSRAM ayrilamadi, kayit kapali."));
+}
+
+MbCapRecord &mbCapSlot(uint32_t n)
+{
+  return g_mbCap.slots[n % MB_CAP_SLOTS];
+}
+
+void mbCapCommit()
+{
+  g_mbCap.written.store(g_mbCap.written.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_release);
+}
+
+void mbCapAppend(MbCapRecord &r, const uint8_t *data, size_t len)
+{
+  size_t room = MB_CAP_DATA_MAX - r.len;
+  if (len > room) {
+    len = room;
+    r.flags |= MB_CAP_FLAG_TRUNC;
+  }
+  memcpy(&r.data[r.len], data, len);
+  r.len += (uint8_t)len;
+}
+
+void mbCapTx(const uint8_t *frame, uint8_t len, uint32_t tUs)
+{
+  if (!g_mbCap.slots) return;
+  mbCapRxClose();
+
+  MbCapRecord &r = mbCapSlot(g_mbCap.written.load(std::memory_order_relaxed));
+  r.tUs   = tUs;
+  r.durUs = 0;
+  r.flags = 0;
+  r.len   = 0;
+  mbCapAppend(r, frame, len);
+  mbCapCommit();
+}
+
+MbCapRecord &mbCapRxOpen(uint32_t tUs)
+{
+  MbCapRecord &r = mbCapSlot(g_mbCap.written.load(std::memory_order_relaxed));
+  if (!g_mbCap.rxOpen) {
+    r.tUs   = tUs;
+    r.durUs = 0;
+    r.flags = MB_CAP_FLAG_RX;
+    r.len   = 0;
+    g_mbCap.rxOpen = true;
   }
+  return r;
 }
 
-// Akilli telefon tarzı "sebekes" ikon (dikey barlar)
-void drawWifiIcon(int16_t x, int16_t y, bool connected)
+void mbCapRx(const uint8_t *data, size_t len, uint32_t tUs)
 {
-  uint16_t colOn  = connected ? TFT_GREEN    : TFT_DARKGREY;
-  uint16_t colOff = TFT_DARKGREY;
+  if (!g_mbCap.slots) return;
 
-  int baseY      = y + TOP_BAR_H - 3;  // alt hizası
-  int barW       = 3;
-  int gap        = 2;
-  int numBars    = 4;
+  MbCapRecord &r = mbCapRxOpen(tUs);
+  uint32_t dur = tUs - r.tUs;
+  r.durUs = dur > 0xFFFF ? 0xFFFF : (uint16_t)dur;
+  mbCapAppend(r, data, len);
+}
 
-  for (int i = 0; i < numBars; i++)
-  {
-    int h   = 4 + i * 3;                // 4, 7, 10, 13 piksel
-    int bx  = x + i * (barW + gap);
-    uint16_t col = connected ? colOn : colOff;
+void mbCapRxResult(MbResult result, bool resync)
+{
+  if (!g_mbCap.slots) return;
 
-    spr.fillRect(bx, baseY - h, barW, h, col);
-  }
+  MbCapRecord &r = mbCapRxOpen(micros());
+  r.flags |= (uint8_t)(result << MB_CAP_RESULT_SHIFT);
+  if (resync) r.flags |= MB_CAP_FLAG_RESYNC;
 }
 
+void mbCapRxClose()
+{
+  if (!g_mbCap.slots || !g_mbCap.rxOpen) return;
+  g_mbCap.rxOpen = false;
+  mbCapCommit();
+}
 
-String getCurrentTimeString()
+void mbCapExportWrite(const uint8_t *data, size_t len)
 {
-  time_t now;
-  struct tm ti;
-  time(&now);
-  localtime_r(&now, &ti);
+  Serial.write(data, len);
+  for (size_t i = 0; i < len; i++) g_mbCapExport.crc = modbusCRC16Update(g_mbCapExport.crc, data[i]);
+}
 
-  int yearFull = ti.tm_year + 1900;
-  if (yearFull < 2020) {
-    return String("--:--:--");
+// Aktarimi baslatir: basligi yazar, kayitlari mbCapExportPump() gonderir.
+// Dolu halka en kotu durumda 8192 x 80 B = 640 KB, 115200 baud'da (~11.5 KB/s)
+// yaklasik 1 dakika; tipik kayitlar 20-30 B oldugundan 15-20 sn surer.
+void mbCapExport()
+{
+  if (!g_mbCap.slots) {
+    Serial.println(F("MBCAP kapali"));
+    return;
   }
-
-  int hh = ti.tm_hour;
-  int mm = ti.tm_min;
-  int ss = ti.tm_sec;
-
-  char buf[16];
-  snprintf(buf, sizeof(buf), "%02d:%02d:%02d", hh, mm, ss);
-  return String(buf);
+  if (g_mbCapExport.active) return;
+
+  uint32_t end = g_mbCap.written.load(std::memory_order_acquire);
+  g_mbCapExport.end    = end;
+  g_mbCapExport.next   = end > MB_CAP_SLOTS ? end - MB_CAP_SLOTS : 0;
+  g_mbCapExport.sent   = 0;
+  g_mbCapExport.torn   = 0;
+  g_mbCapExport.crc    = 0xFFFF;
+  g_mbCapExport.active = true;
+  g_mbLogMuted = true;
+
+  uint8_t hdr[12];
+  memcpy(&hdr[0], "MBC1", 4);
+  memcpy(&hdr[4], &g_rs485Baud, 4);
+  memcpy(&hdr[8], &end, 4);
+
+  Serial.println(F("MBCAP BEGIN"));
+  mbCapExportWrite(hdr, sizeof(hdr));
 }
 
-String getCurrentDateString()
+// loop()'tan cagrilir; TX tamponunda yer kalmayinca ya da tur butcesi
+// dolunca doner, yani loop() en fazla birkac kayit kopyasi kadar bekler.
+void mbCapExportPump()
 {
-  time_t now;
-  struct tm ti;
-  time(&now);
-  localtime_r(&now, &ti);
+  MbCapExport &x = g_mbCapExport;
+  if (!x.active) return;
+
+  MbCapRecord rec;
+  size_t budget = MB_CAP_EXPORT_CHUNK;
+  while (x.next < x.end) {
+    if (budget < sizeof(rec) || Serial.availableForWrite() < (int)sizeof(rec)) return;
+
+    uint32_t n = x.next++;
+    memcpy(&rec, &mbCapSlot(n), sizeof(rec));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (g_mbCap.written.load(std::memory_order_acquire) >= n + MB_CAP_SLOTS) {
+      x.torn++;     // yazar bu yuvaya dondu, kopya guvenilmez
+      continue;
+    }
+    if (rec.len > MB_CAP_DATA_MAX) rec.len = MB_CAP_DATA_MAX;
 
-  int yearFull = ti.tm_year + 1900;
-  if (yearFull < 2020) {
-    return String("--.--.--");
+    size_t len = MB_CAP_REC_HDR + rec.len;
+    mbCapExportWrite((const uint8_t *)&rec, len);
+    budget -= len;
+    x.sent++;
   }
 
-  int dd = ti.tm_mday;
-  int mo = ti.tm_mon + 1;
-  int yy = yearFull % 100;
+  memset(&rec, 0, MB_CAP_REC_HDR);
+  rec.flags = MB_CAP_FLAG_END;
+  mbCapExportWrite((const uint8_t *)&rec, MB_CAP_REC_HDR);
 
-  char buf[16];
-  snprintf(buf, sizeof(buf), "%02d.%02d.%02d", dd, mo, yy);
-  return String(buf);
+  Serial.printf("\nMBCAP END %lu %lu %04X\n", (unsigned long)x.sent, (unsigned long)x.torn, x.crc);
+  x.active = false;
+  g_mbLogMuted = false;
 }
 
-void drawTopBar(const char* title)
+// Servis konsolu: tek harfli komutlar
+// m = Modbus kaydini aktar, f = ekran kare istatistikleri,
+// r = RFID sorgu istatistikleri
+// Aktarim surerken yeni komut okunmaz, cevabi ikili akisa karisirdi.
+void handleSerialCommands()
 {
-  int16_t sw = spr.width();
-  spr.fillRect(0, 0, sw, TOP_BAR_H, TFT_BLUE);
-
-  bool wifiConnected = (WiFi.status() == WL_CONNECTED);
-  drawWifiIcon(2, 0, wifiConnected);
-
-  String dateStr = getCurrentDateString();
-  String timeStr = getCurrentTimeString();
-
-  spr.setTextFont(FONT_MAIN);
-  spr.setTextColor(TFT_WHITE, TFT_BLUE);
+  if (g_mbCapExport.active) {
+    mbCapExportPump();
+    return;
+  }
 
-  spr.setTextDatum(TR_DATUM);
-  spr.drawString(dateStr, sw - 4, 4);
+  while (Serial.available() > 0) {
+    int c = Serial.read();
+    if (c == 'm') mbCapExport();
+    if (c == 'f') lcdPrintFrameStats();
+    if (c == 'r') rfidPrintStats();
+  }
+}
 
-  spr.setTextDatum(BR_DATUM);
-  spr.drawString(timeStr, sw - 4, TOP_BAR_H - 2);
+bool mbBusy()
+{
+  return g_mb.state != MB_STATE_IDLE;
+}
 
-  spr.setTextDatum(MC_DATUM);
-  spr.drawString(title, sw / 2, TOP_BAR_H / 2 + 2);
+// Bus bos ve son cerceveden bu yana asgari sessizlik gecti mi?
+bool mbReady()
+{
+  return !mbBusy() && (micros() - g_mbLastFrameEndUs >= g_mbT35Us);
 }
 
-void updateTopBarForCurrentScreen()
+// Istek cercevesini (CRC haric) gonderir ve hemen doner; cevap mbPoll() ile
+// toplanir. readQty > 0 ise cevap FC03/FC17 tipindedir, degilse FC06 echo.
+bool mbSubmitFrame(const uint8_t *pdu, uint8_t pduLen, uint16_t readQty, uint16_t *outRegs,
+                   MbDoneCallback onDone, void *ctx)
 {
-  const char* title = getScreenTitle(currentScreen);
-  drawTopBar(title);
-  spr.pushSprite(0, 0);
+  if (!mbReady()) return false;
+  if (pduLen < 2 || pduLen + 2 > MB_TX_BUF_SIZE) return false;
+  if (readQty > MB_MAX_READ_REGS || (readQty > 0 && !outRegs)) return false;
+
+  uint8_t *frame = g_mb.txFrame;
+  memcpy(frame, pdu, pduLen);
+  uint16_t crc = modbusCRC16(frame, pduLen);
+  frame[pduLen]     = (uint8_t)(crc & 0xFF);
+  frame[pduLen + 1] = (uint8_t)((crc >> 8) & 0xFF);
+
+  g_mb.txLen      = pduLen + 2;
+  g_mb.slaveAddr  = pdu[0];
+  g_mb.fc         = pdu[1];
+  g_mb.readQty    = readQty;
+  g_mb.outRegs    = outRegs;
+  g_mb.onDone     = onDone;
+  g_mb.ctx        = ctx;
+  g_mb.result     = MB_RESULT_NONE;
+  mbRxBegin(g_mb);
+
+  rs485RxFlush();
+
+  g_mb.submitUs = micros();
+  rs485TxFrame(frame, g_mb.txLen);
+  mbCapTx(frame, g_mb.txLen, g_mb.submitUs);
+
+  // Cevabin tamami icin tek sure: okuma = 5 + 2*adet bayt, FC06 = 8 bayt echo.
+  // Sure gonderim anindan sayildigi icin cercevenin hattaki suresi eklenir.
+  uint16_t respLen = (readQty > 0) ? 5 + 2 * readQty : 8;
+
+  g_mb.respStartUs   = g_mb.submitUs;
+  g_mb.lastRxUs      = g_mb.respStartUs;
+  g_mb.respTimeoutUs = g_mb.txLen * g_mbCharUs +
+                       g_mbTurnaroundUs + (respLen + MB_RX_SLACK_CHARS) * g_mbCharUs + g_mbT35Us;
+  g_mb.state         = MB_STATE_WAIT_RESP;
+  return true;
 }
 
-// -----------------------------------------------------------------------------
-// WiFi + NTP yönetimi
-// -----------------------------------------------------------------------------
-void handleWifiAndTime()
+// FC03 / FC06 icin sabit 6 baytlik istek
+bool mbSubmit(uint8_t slaveAddr, uint8_t fc, uint16_t regAddr, uint16_t value,
+              uint16_t *outRegs, MbDoneCallback onDone, void *ctx)
 {
-  // Artık burada otomatik WiFi baglanti denemiyoruz.
-  // Sadece baglanti kurulmus ise NTP zamanini ayarliyoruz.
-  if (WiFi.status() == WL_CONNECTED && !timeConfigured)
-  {
-    Serial.print(F("WiFi baglandi. IP: "));
-    Serial.println(WiFi.localIP());
-    Serial.println(F("NTP ayarlaniyor..."));
-    configTime(GMT_OFFSET_SEC, DAYLIGHT_OFFSET_SEC, NTP_SERVER);
-    timeConfigured = true;
-  }
+  uint8_t pdu[6];
+  pdu[0] = slaveAddr;
+  pdu[1] = fc;
+  pdu[2] = (uint8_t)((regAddr >> 8) & 0xFF);
+  pdu[3] = (uint8_t)(regAddr & 0xFF);
+  pdu[4] = (uint8_t)((value >> 8) & 0xFF);
+  pdu[5] = (uint8_t)(value & 0xFF);
+
+  uint16_t readQty = (fc == MB_FC_READ_HOLDING) ? value : 0;
+  return mbSubmitFrame(pdu, sizeof(pdu), readQty, outRegs, onDone, ctx);
 }
 
-// WiFi: bloklu baglanma denemesi
-bool wifiAttemptConnectBlocking(const String &ssid, const String &password)
+// Bozuk, eksik veya CRC'si tutmayan cevaptan sonra hatta kalan baytlar
+// bir sonraki islemi bozmasin diye bus RESYNC'e gecer; mbPoll hat sessiz
+// kalana kadar gelenleri atar. Temiz biten islemlerde (OK, exception, hic
+// bayt gelmeyen timeout) dogrudan IDLE.
+void mbFinish(MbResult result)
 {
-  Serial.printf("WiFi baglantisi (bloklu) deneniyor: %s\n", ssid.c_str());
+  bool dirty = (result == MB_RESULT_BAD_FRAME || result == MB_RESULT_CRC ||
+                (result == MB_RESULT_TIMEOUT && g_mb.rxLen > 0));
 
-  WiFi.mode(WIFI_STA);
-  WiFi.disconnect(true, true);
-  delay(100);
-  WiFi.begin(ssid.c_str(), password.c_str());
+  g_mb.state  = dirty ? MB_STATE_RESYNC : MB_STATE_IDLE;
+  g_mb.result = result;
+  g_mbLastFrameEndUs = micros();
+  if (dirty) g_mbResyncCount++;
 
-  unsigned long start = millis();
-  const unsigned long timeout = 15000; // 15 saniye
+  // RESYNC'te atilan baytlar da ayni RX kaydina eklenir, kayit sessizlikte kapanir
+  mbCapRxResult(result, dirty);
+  if (!dirty) mbCapRxClose();
 
-  while (WiFi.status() != WL_CONNECTED && (millis() - start) < timeout)
-  {
-    delay(200);
-  }
+  // Callback icinden yeni istek gonderilebilsin diye state once temizlenir
+  if (g_mb.onDone) g_mb.onDone(result, g_mb.ctx);
+}
 
-  if (WiFi.status() == WL_CONNECTED)
-  {
-    Serial.print(F("WiFi baglandi. IP: "));
-    Serial.println(WiFi.localIP());
-    wifiClientStarted = true;
-    timeConfigured    = false;
-    return true;
-  }
-  else
-  {
-    Serial.println(F("WiFi baglanamadi (timeout veya hata)."));
-    wifiClientStarted = false;
-    return false;
+void mbLogPrefix(const MbTransaction &t)
+{
+  switch (t.fc) {
+    case MB_FC_READ_HOLDING:     Serial.print(F("modbusReadHolding: "));         break;
+    case MB_FC_WRITE_SINGLE_REG: Serial.print(F("modbusWriteSingleRegister: ")); break;
+    default:                     Serial.print(F("modbusReadWriteRegisters: "));  break;
   }
 }
 
-// -----------------------------------------------------------------------------
-// RS485 / Modbus Fonksiyonlari
-// -----------------------------------------------------------------------------
-void initRs485()
+void mbLogError(const MbTransaction &t, const __FlashStringHelper *msg)
 {
-  pinMode(RS485_REDE_PIN, OUTPUT);
-  rs485SetRx();
-  RS485Serial.begin(19200, SERIAL_8N1, RS485_RX_PIN, RS485_TX_PIN);
-  Serial.println(F("RS485 baslatildi (UART2, 19200 8N1)."));
+  if (g_mbLogMuted) return;
+  mbLogPrefix(t);
+  Serial.println(msg);
 }
 
-void rs485SetTx()
+void mbLogRxError(const MbTransaction &t, MbResult result)
 {
-  digitalWrite(RS485_REDE_PIN, HIGH);
+  if (g_mbLogMuted) return;
+  if (result == MB_RESULT_EXCEPTION) {
+    mbLogPrefix(t);
+    Serial.printf("exception 0x%02X (%s)\n", t.exceptionCode, mbExceptionName(t.exceptionCode));
+    return;
+  }
+
+  switch (t.rxError) {
+    case MB_RXERR_ADDR:       mbLogError(t, F("slave addr farkli")); break;
+    case MB_RXERR_BYTE_COUNT: mbLogError(t, F("byteCount farkli"));  break;
+    case MB_RXERR_CRC:        mbLogError(t, F("CRC hatasi"));        break;
+    case MB_RXERR_ECHO:       mbLogError(t, F("echo farkli"));       break;
+    case MB_RXERR_OVERRUN:    mbLogError(t, F("fazla bayt"));        break;
+    case MB_RXERR_FC:
+      mbLogPrefix(t);
+      Serial.printf("fn kodu farkli: 0x%02X\n", t.rxBadByte);
+      break;
+    default:
+      break;
+  }
 }
 
-void rs485SetRx()
+const char *mbResultName(MbResult result)
 {
-  digitalWrite(RS485_REDE_PIN, LOW);
+  switch (result) {
+    case MB_RESULT_OK:        return "ok";
+    case MB_RESULT_TIMEOUT:   return "timeout";
+    case MB_RESULT_CRC:       return "CRC";
+    case MB_RESULT_BAD_FRAME: return "bozuk cerceve";
+    case MB_RESULT_EXCEPTION: return "exception";
+    default:                  return "?";
+  }
 }
 
-uint16_t modbusCRC16(const uint8_t *data, uint16_t length)
+const char *mbExceptionName(uint8_t code)
 {
-  uint16_t crc = 0xFFFF;
-  for (uint16_t pos = 0; pos < length; pos++) {
-    crc ^= (uint16_t)data[pos];
-    for (uint8_t i = 0; i < 8; i++) {
-      if (crc & 0x0001) {
-        crc >>= 1;
-        crc ^= 0xA001;
-      } else {
-        crc >>= 1;
-      }
-    }
+  switch (code) {
+    case MB_EX_ILLEGAL_FUNCTION: return "illegal function";
+    case MB_EX_ILLEGAL_ADDRESS:  return "illegal data address";
+    case MB_EX_ILLEGAL_VALUE:    return "illegal data value";
+    case MB_EX_DEVICE_FAILURE:   return "slave device failure";
+    case MB_EX_ACKNOWLEDGE:      return "acknowledge";
+    case MB_EX_DEVICE_BUSY:      return "slave device busy";
+    default:                     return "?";
   }
-  return crc;
 }
 
-bool rs485ReadBytes(uint8_t *buf, uint16_t len, uint32_t timeoutMs)
+// Cerceve sonu sayilacak sessizlik: t3.5 + UART'in baytlari gec teslim payi
+uint32_t mbSilenceUs()
 {
-  uint32_t start = millis();
-  uint16_t index = 0;
-  while (index < len) {
-    if (RS485Serial.available() > 0) {
-      buf[index++] = (uint8_t)RS485Serial.read();
-    } else {
-      if (millis() - start > timeoutMs) return false;
-      delay(1);
-    }
-  }
-  return true;
+  return g_mbT35Us + MB_RX_SLACK_CHARS * g_mbCharUs;
 }
 
-bool modbusWriteSingleRegister(uint8_t slaveAddr, uint16_t regAddr, uint16_t value)
+// Parser durumunu yeni cevap icin sifirlar (slaveAddr/fc/readQty/outRegs/
+// txFrame onceden doldurulmus olmali)
+void mbRxBegin(MbTransaction &t)
 {
-  uint8_t frame[8];
-  frame[0] = slaveAddr;
-  frame[1] = MB_FC_WRITE_SINGLE_REG;
-  frame[2] = (uint8_t)((regAddr >> 8) & 0xFF);
-  frame[3] = (uint8_t)(regAddr & 0xFF);
-  frame[4] = (uint8_t)((value >> 8) & 0xFF);
-  frame[5] = (uint8_t)(value & 0xFF);
-  uint16_t crc = modbusCRC16(frame, 6);
-  frame[6] = (uint8_t)(crc & 0xFF);
-  frame[7] = (uint8_t)((crc >> 8) & 0xFF);
+  t.rxLen         = 0;
+  // Okuma: once header (addr, fn, byteCount), FC06: 8 byte echo
+  t.rxExpected    = (t.readQty > 0) ? 3 : 8;
+  t.rxCrc         = 0xFFFF;
+  t.rxHiByte      = 0;
+  t.rxEchoErr     = false;
+  t.rxException   = false;
+  t.exceptionCode = 0;
+  t.rxError       = MB_RXERR_NONE;
+  t.rxBadByte     = 0;
+}
 
-  while (RS485Serial.available() > 0) RS485Serial.read();
+// Cevabin tek bir baytini isler: CRC'yi gunceller, okunan register'lari
+// ara buffer olmadan dogrudan outRegs'e yazar. Cerceve CRC dahil bastan sona
+// islendiginde kalan CRC 0 olmalidir, yani sonuc son bayt ile hazirdir.
+// outRegs sadece MB_RESULT_OK durumunda gecerlidir.
+// Saf fonksiyondur: sadece t'ye dokunur, log basmaz, I/O yapmaz. Hangi bayt
+// dizisi gelirse gelsin outRegs[0 .. readQty) disina yazmaz; bu, gomulu
+// fuzz testiyle (-DMODBUS_PARSER_FUZZ) dogrulanir.
+// Donus: MB_RESULT_NONE = cerceve henuz tamamlanmadi.
+MbResult mbRxByte(MbTransaction &t, uint8_t b)
+{
+  // Sonuc dondukten sonra gelen bayt: cagiran cerceveyi kapatmaliydi
+  if (t.rxLen >= t.rxExpected) {
+    t.rxError = MB_RXERR_OVERRUN;
+    return MB_RESULT_BAD_FRAME;
+  }
 
-  rs485SetTx();
-  RS485Serial.write(frame, 8);
-  RS485Serial.flush();
-  rs485SetRx();
+  uint16_t pos = t.rxLen++;
+  t.rxCrc = modbusCRC16Update(t.rxCrc, b);
 
-  uint8_t resp[8];
-  if (!rs485ReadBytes(resp, 8, 100)) {
-    Serial.println(F("modbusWriteSingleRegister: timeout"));
-    return false;
+  if (pos == 0 && b != t.slaveAddr) {
+    t.rxError   = MB_RXERR_ADDR;
+    t.rxBadByte = b;
+    return MB_RESULT_BAD_FRAME;
   }
 
-  uint16_t recvCrc = (uint16_t)resp[6] | ((uint16_t)resp[7] << 8);
-  uint16_t calcCrc = modbusCRC16(resp, 6);
-  if (recvCrc != calcCrc) {
-    Serial.println(F("modbusWriteSingleRegister: CRC hatasi"));
-    return false;
+  if (pos == 1 && b != t.fc) {
+    if (b == (t.fc | MB_EXCEPTION_BIT)) {
+      // Exception cercevesi: addr, fn|0x80, kod, CRC (5 bayt) sonuna kadar okunur
+      t.rxException = true;
+      t.rxExpected  = 5;
+      return MB_RESULT_NONE;
+    }
+    t.rxError   = MB_RXERR_FC;
+    t.rxBadByte = b;
+    return MB_RESULT_BAD_FRAME;
   }
 
-  if (resp[0] != slaveAddr || resp[1] != MB_FC_WRITE_SINGLE_REG) {
-    Serial.println(F("modbusWriteSingleRegister: addr/fn hatali"));
-    return false;
+  if (t.rxException) {
+    if (pos == 2) t.exceptionCode = b;
+  } else if (t.readQty > 0) {
+    if (pos == 2) {
+      uint16_t expectedBytes = t.readQty * 2;
+      if (b != expectedBytes || t.readQty > MB_MAX_READ_REGS) {
+        t.rxError   = MB_RXERR_BYTE_COUNT;
+        t.rxBadByte = b;
+        return MB_RESULT_BAD_FRAME;
+      }
+      t.rxExpected = 3 + b + 2;
+    }
+
+    if (pos >= 3 && pos < t.rxExpected - 2) {
+      uint16_t off = pos - 3;
+      if (off & 1) {
+        uint16_t idx = off >> 1;
+        if (idx < t.readQty) t.outRegs[idx] = ((uint16_t)t.rxHiByte << 8) | b;
+      } else {
+        t.rxHiByte = b;
+      }
+    }
+  } else if (pos < 6 && b != t.txFrame[pos]) {
+    // FC06 cevabi istegin ilk 6 baytinin aynisi olmali
+    t.rxEchoErr = true;
   }
 
-  uint16_t regEcho = ((uint16_t)resp[2] << 8) | resp[3];
-  uint16_t valEcho = ((uint16_t)resp[4] << 8) | resp[5];
-  if (regEcho != regAddr || valEcho != value) {
-    Serial.println(F("modbusWriteSingleRegister: echo farkli"));
-    return false;
+  if (t.rxLen < t.rxExpected) return MB_RESULT_NONE;
+
+  if (t.rxCrc != 0) {
+    t.rxError = MB_RXERR_CRC;
+    return MB_RESULT_CRC;
   }
 
-  return true;
+  if (t.rxException) return MB_RESULT_EXCEPTION;
+
+  if (t.rxEchoErr) {
+    t.rxError = MB_RXERR_ECHO;
+    return MB_RESULT_BAD_FRAME;
+  }
+
+  return MB_RESULT_OK;
 }
 
-bool modbusReadHoldingRegisters(uint8_t slaveAddr, uint16_t startAddr, uint16_t quantity, uint16_t *outRegs)
+#ifdef MODBUS_PARSER_FUZZ
+// -DMODBUS_PARSER_FUZZ ile derlenirse setup() sonunda calisir.
+// Ornek cevap cercevelerinden (FC03/FC06/FC17/exception) bit cevirme,
+// bayt ekleme/silme, kesme ve rastgele byteCount ile turetilmis girdileri
+// mbRxByte'a verir ve su kurallari kontrol eder:
+//  - outRegs[readQty] sonrasindaki bekci degerlere hic yazilmaz
+//  - rxLen hicbir zaman en uzun gecerli cerceveyi asmaz
+//  - OK donduyse tuketilen baytlarin CRC'si 0'dir ve register'lar
+//    cercevedeki degerlerle birebir aynidir
+struct MbFuzzSeed
 {
-  if (quantity == 0) return false;
+  uint8_t fc;
+  uint8_t readQty;
+  uint8_t len;
+  uint8_t bytes[5 + 2 * 6];
+};
 
-  uint8_t frame[8];
-  frame[0] = slaveAddr;
-  frame[1] = MB_FC_READ_HOLDING;
-  frame[2] = (uint8_t)((startAddr >> 8) & 0xFF);
-  frame[3] = (uint8_t)(startAddr & 0xFF);
-  frame[4] = (uint8_t)((quantity >> 8) & 0xFF);
-  frame[5] = (uint8_t)(quantity & 0xFF);
-  uint16_t crc = modbusCRC16(frame, 6);
-  frame[6] = (uint8_t)(crc & 0xFF);
-  frame[7] = (uint8_t)((crc >> 8) & 0xFF);
+// Slave 1 ornek cevaplari (CRC'leri calisma zamaninda yeniden hesaplanir)
+const MbFuzzSeed MB_FUZZ_SEEDS[] = {
+  { MB_FC_READ_HOLDING,     6, 17, { 0x01, 0x03, 0x0C, 0x00, 0x0B, 0x00, 0x00, 0x04, 0xD2,
+                                     0x00, 0x12, 0xD6, 0x87, 0x0F, 0xA0 } },
+  { MB_FC_READ_HOLDING,     1,  7, { 0x01, 0x03, 0x02, 0x00, 0x01 } },
+  { MB_FC_WRITE_SINGLE_REG, 0,  8, { 0x01, 0x06, 0x00, 0x00, 0x00, 0x01 } },
+  { MB_FC_READ_WRITE_MULTI, 6, 17, { 0x01, 0x17, 0x0C, 0x00, 0x0B, 0x00, 0x00, 0x00, 0x00,
+                                     0x00, 0x12, 0xD6, 0x87, 0x00, 0x00 } },
+  { MB_FC_READ_HOLDING,     6,  5, { 0x01, 0x83, 0x02 } },
+};
 
-  while (RS485Serial.available() > 0) RS485Serial.read();
+#define MB_FUZZ_ITER     20000
+#define MB_FUZZ_CANARY   0xA5A5
+#define MB_FUZZ_MAX_LEN  (5 + 2 * MB_MAX_READ_REGS + 8)
 
-  rs485SetTx();
-  RS485Serial.write(frame, 8);
-  RS485Serial.flush();
-  rs485SetRx();
+uint16_t mbFuzzRand(uint32_t &seed)
+{
+  seed = seed * 1103515245UL + 12345UL;
+  return (uint16_t)(seed >> 16);
+}
 
-  uint8_t hdr[3];
-  if (!rs485ReadBytes(hdr, 3, 100)) {
-    Serial.println(F("modbusReadHolding: timeout header"));
-    return false;
+void mbParserFuzz()
+{
+  static MbTransaction t;
+  uint16_t regs[MB_MAX_READ_REGS + 4];
+  uint8_t  in[MB_FUZZ_MAX_LEN];
+  uint32_t seed = 0xC0FFEE01;
+  uint32_t counts[6] = { 0 };
+  const uint8_t nSeeds = sizeof(MB_FUZZ_SEEDS) / sizeof(MB_FUZZ_SEEDS[0]);
+
+  for (uint32_t it = 0; it < MB_FUZZ_ITER; it++) {
+    const MbFuzzSeed &sd = MB_FUZZ_SEEDS[it % nSeeds];
+    uint16_t len = sd.len;
+    memcpy(in, sd.bytes, len - 2);
+    uint16_t crc = modbusCRC16(in, len - 2);
+    in[len - 2] = (uint8_t)(crc & 0xFF);
+    in[len - 1] = (uint8_t)(crc >> 8);
+
+    // Mutasyonlar (her iterasyonda 0-3 tane)
+    uint8_t nMut = mbFuzzRand(seed) % 4;
+    for (uint8_t k = 0; k < nMut; k++) {
+      uint16_t r = mbFuzzRand(seed);
+      switch (r % 5) {
+        case 0: in[r % len] ^= (uint8_t)(1 << (mbFuzzRand(seed) % 8)); break;
+        case 1: { uint16_t at = mbFuzzRand(seed) % len; in[at] = (uint8_t)mbFuzzRand(seed); } break;
+        case 2: if (len > 1) len = 1 + mbFuzzRand(seed) % (len - 1); break;
+        case 3: if (len < MB_FUZZ_MAX_LEN) in[len++] = (uint8_t)mbFuzzRand(seed); break;
+        case 4: if (len > 2) in[2] = (uint8_t)mbFuzzRand(seed); break;   // byteCount
+      }
+    }
+    // Ara sira CRC'yi tutarli yap: parser'in CRC sonrasi kontrolleri de denensin
+    if ((mbFuzzRand(seed) & 3) == 0 && len > 2) {
+      crc = modbusCRC16(in, len - 2);
+      in[len - 2] = (uint8_t)(crc & 0xFF);
+      in[len - 1] = (uint8_t)(crc >> 8);
+    }
+
+    // Istek tarafi: bazen seed'den farkli readQty (0..MB_MAX_READ_REGS)
+    memset(&t, 0, sizeof(t));
+    t.slaveAddr = 0x01;
+    t.fc        = sd.fc;
+    t.readQty   = sd.readQty;
+    if ((mbFuzzRand(seed) & 7) == 0) t.readQty = mbFuzzRand(seed) % (MB_MAX_READ_REGS + 1);
+    if (t.fc == MB_FC_WRITE_SINGLE_REG && (mbFuzzRand(seed) & 1)) t.readQty = 0;
+    t.outRegs   = regs;
+    memcpy(t.txFrame, MB_FUZZ_SEEDS[2].bytes, 6);
+    for (uint16_t i = 0; i < MB_MAX_READ_REGS + 4; i++) regs[i] = MB_FUZZ_CANARY;
+    mbRxBegin(t);
+
+    MbResult res = MB_RESULT_NONE;
+    uint16_t used = 0;
+    while (used < len && res == MB_RESULT_NONE) res = mbRxByte(t, in[used++]);
+
+    bool bad = false;
+    for (uint16_t i = t.readQty; i < MB_MAX_READ_REGS + 4; i++)
+      if (regs[i] != MB_FUZZ_CANARY) bad = true;
+    if (t.rxLen > 5 + 2 * MB_MAX_READ_REGS) bad = true;
+    if (res == MB_RESULT_OK) {
+      if (modbusCRC16(in, used) != 0) bad = true;
+      for (uint16_t i = 0; i < t.readQty && !bad; i++)
+        if (regs[i] != (((uint16_t)in[3 + 2 * i] << 8) | in[4 + 2 * i])) bad = true;
+    }
+
+    if (bad) {
+      Serial.printf("Parser fuzz: KURAL IHLALI it=%lu fc=0x%02X qty=%u len=%u sonuc=%s\n",
+                    (unsigned long)it, t.fc, t.readQty, len, mbResultName(res));
+      return;
+    }
+    counts[res < 6 ? res : 0]++;
   }
 
-  if (hdr[0] != slaveAddr) {
-    Serial.println(F("modbusReadHolding: slave addr farkli"));
-    return false;
+  Serial.printf("Parser fuzz: %u girdi temiz (eksik %lu, ok %lu, crc %lu, bozuk %lu, exc %lu)\n",
+                MB_FUZZ_ITER, (unsigned long)counts[MB_RESULT_NONE],
+                (unsigned long)counts[MB_RESULT_OK], (unsigned long)counts[MB_RESULT_CRC],
+                (unsigned long)counts[MB_RESULT_BAD_FRAME], (unsigned long)counts[MB_RESULT_EXCEPTION]);
+}
+#endif // MODBUS_PARSER_FUZZ
+
+// loop() her turunda cagrilir; sadece UART'ta bekleyen byte'lari okur.
+void mbPoll()
+{
+  if (g_mb.state == MB_STATE_IDLE) return;
+
+  // Sessizlik kararlari tampona bakmadan once alinan zamanla verilir; bayt
+  // gelmisse son bayt zamani okumadan sonra alinir. Arada gorev kesilirse
+  // ne gec gelen baytlar sessizlik sayilir ne de sessizlik kisalir.
+  uint32_t now   = micros();
+  size_t   avail = rs485RxAvailable();
+
+  if (g_mb.state == MB_STATE_RESYNC) {
+    if (avail > 0) {
+      // Atilan baytlar da okunup kayda eklenir: teshiste en degerli kisim
+      uint8_t dropBuf[32];
+      while (avail > 0) {
+        int n = rs485RxRead(dropBuf, avail < sizeof(dropBuf) ? avail : sizeof(dropBuf));
+        if (n <= 0) break;
+        avail -= n;
+        g_mbDiscardedBytes += n;
+        g_mb.lastRxUs = micros();
+        mbCapRx(dropBuf, n, g_mb.lastRxUs);
+      }
+      return;
+    }
+
+    // Hat t3.5 (+ UART payi) sessiz: bir sonraki cerceve temiz baslar
+    if (now - g_mb.lastRxUs >= mbSilenceUs()) {
+      g_mb.state = MB_STATE_IDLE;
+      g_mbLastFrameEndUs = g_mb.lastRxUs;
+      mbCapRxClose();
+    }
+    return;
   }
 
-  if (hdr[1] != MB_FC_READ_HOLDING) {
-    Serial.print(F("modbusReadHolding: fn kodu: 0x"));
-    Serial.println(hdr[1], HEX);
-    return false;
+  // Surucu tamponundan blok halinde okunur, parser'a bayt bayt verilir
+  uint8_t rxBuf[32];
+  bool gotBytes = avail > 0;
+  while (avail > 0) {
+    int n = rs485RxRead(rxBuf, avail < sizeof(rxBuf) ? avail : sizeof(rxBuf));
+    if (n <= 0) break;
+    avail -= n;
+    g_mb.lastRxUs = micros();
+    mbCapRx(rxBuf, n, g_mb.lastRxUs);
+
+    for (int i = 0; i < n; i++) {
+      MbResult res = mbRxByte(g_mb, rxBuf[i]);
+      if (res != MB_RESULT_NONE) {
+        if (res != MB_RESULT_OK) mbLogRxError(g_mb, res);
+        mbFinish(res);
+        return;
+      }
+    }
   }
 
-  uint8_t byteCount = hdr[2];
-  uint16_t expectedBytes = quantity * 2;
-  if (byteCount != expectedBytes) {
-    Serial.println(F("modbusReadHolding: byteCount farkli"));
-    return false;
+  // Cerceve basladi ama t3.5'ten uzun sessizlik: slave eksik cerceve gonderdi,
+  // timeout'u beklemeden bitir
+  if (!gotBytes && g_mb.rxLen > 0 && now - g_mb.lastRxUs >= mbSilenceUs()) {
+    mbLogError(g_mb, F("eksik cerceve"));
+    mbFinish(MB_RESULT_BAD_FRAME);
+    return;
   }
 
-  uint16_t remain = byteCount + 2;
-  uint8_t buf2[64];
-  if (!rs485ReadBytes(buf2, remain, 100)) {
-    Serial.println(F("modbusReadHolding: timeout data+crc"));
-    return false;
+  if (now - g_mb.respStartUs > g_mb.respTimeoutUs) {
+    if (g_mb.readQty > 0)
+      mbLogError(g_mb, g_mb.rxLen < 3 ? F("timeout header") : F("timeout data+crc"));
+    else
+      mbLogError(g_mb, F("timeout"));
+    mbFinish(MB_RESULT_TIMEOUT);
   }
+}
 
-  uint8_t full[3 + 64];
-  full[0] = hdr[0];
-  full[1] = hdr[1];
-  full[2] = hdr[2];
-  memcpy(full + 3, buf2, remain);
-  uint16_t fullLen = 3 + remain;
+bool modbusWriteSingleRegister(uint8_t slaveAddr, uint16_t regAddr, uint16_t value,
+                               MbDoneCallback onDone, void *ctx)
+{
+  return mbSubmit(slaveAddr, MB_FC_WRITE_SINGLE_REG, regAddr, value, nullptr, onDone, ctx);
+}
 
-  uint16_t recvCrc = (uint16_t)buf2[remain - 2] | ((uint16_t)buf2[remain - 1] << 8);
-  uint16_t calcCrc = modbusCRC16(full, fullLen - 2);
-  if (recvCrc != calcCrc) {
-    Serial.println(F("modbusReadHolding: CRC hatasi"));
-    return false;
-  }
+bool modbusReadHoldingRegisters(uint8_t slaveAddr, uint16_t startAddr, uint16_t quantity, uint16_t *outRegs,
+                                MbDoneCallback onDone, void *ctx)
+{
+  if (quantity == 0 || quantity > MB_MAX_READ_REGS || !outRegs) return false;
+  return mbSubmit(slaveAddr, MB_FC_READ_HOLDING, startAddr, quantity, outRegs, onDone, ctx);
+}
 
-  for (uint16_t i = 0; i < quantity; i++) {
-    uint16_t hi = buf2[2 * i];
-    uint16_t lo = buf2[2 * i + 1];
-    outRegs[i] = (hi << 8) | lo;
+// FC17: once writeRegs yazilir, sonra (ayni cevapta) okuma yapilir
+bool modbusReadWriteRegisters(uint8_t slaveAddr, uint16_t readStart, uint16_t readQty, uint16_t *outRegs,
+                              uint16_t writeStart, const uint16_t *writeRegs, uint16_t writeQty,
+                              MbDoneCallback onDone, void *ctx)
+{
+  if (readQty == 0 || readQty > MB_MAX_READ_REGS || !outRegs) return false;
+  if (writeQty == 0 || writeQty > MB_MAX_WRITE_REGS || !writeRegs) return false;
+
+  uint8_t pdu[11 + 2 * MB_MAX_WRITE_REGS];
+  pdu[0]  = slaveAddr;
+  pdu[1]  = MB_FC_READ_WRITE_MULTI;
+  pdu[2]  = (uint8_t)((readStart >> 8) & 0xFF);
+  pdu[3]  = (uint8_t)(readStart & 0xFF);
+  pdu[4]  = (uint8_t)((readQty >> 8) & 0xFF);
+  pdu[5]  = (uint8_t)(readQty & 0xFF);
+  pdu[6]  = (uint8_t)((writeStart >> 8) & 0xFF);
+  pdu[7]  = (uint8_t)(writeStart & 0xFF);
+  pdu[8]  = (uint8_t)((writeQty >> 8) & 0xFF);
+  pdu[9]  = (uint8_t)(writeQty & 0xFF);
+  pdu[10] = (uint8_t)(writeQty * 2);
+  for (uint16_t i = 0; i < writeQty; i++) {
+    pdu[11 + 2 * i]     = (uint8_t)((writeRegs[i] >> 8) & 0xFF);
+    pdu[11 + 2 * i + 1] = (uint8_t)(writeRegs[i] & 0xFF);
   }
 
-  return true;
+  return mbSubmitFrame(pdu, 11 + 2 * writeQty, readQty, outRegs, onDone, ctx);
 }
 
-bool meterStartSession()
+// Callback'e ctx olarak &m verilir
+bool meterStartSession(Meter &m, MbDoneCallback onDone)
 {
-  Serial.println(F("meterStartSession(): CONTROL_CMD=1"));
-  return modbusWriteSingleRegister(MB_SLAVE_ADDR, REG_CONTROL_CMD, 1);
+  const MeterRegMap &map = *m.model->map;
+  if (!g_mbLogMuted)
+    Serial.printf("meterStartSession(): slave %u CONTROL_CMD=%u\n", m.slaveAddr, map.startCmd);
+  return modbusWriteSingleRegister(m.slaveAddr, map.controlAddr, map.startCmd, onDone, &m);
 }
 
-bool meterRead(MeterData &out)
+// Tek cerceve: komut yazilir ve ayni cevapta planin ilk okumasi gelir
+bool meterStartSessionRw(Meter &m, MbDoneCallback onDone)
 {
-  uint16_t regs[6];
-  if (!modbusReadHoldingRegisters(MB_SLAVE_ADDR, REG_STATUS_FLAGS, 6, regs)) {
-    return false;
+  const MeterRegMap   &map = *m.model->map;
+  const MeterReadSpan &rd  = m.plan.reads[0];
+  if (!g_mbLogMuted)
+    Serial.printf("meterStartSession(): slave %u FC17 CONTROL_CMD=%u + durum\n", m.slaveAddr, map.startCmd);
+  return modbusReadWriteRegisters(m.slaveAddr, rd.start, rd.qty, &m.regs[rd.start - map.base],
+                                  map.controlAddr, &map.startCmd, 1, onDone, &m);
+}
+
+// Planin siradaki okumasi; sonuc m.regs goruntusune yazilir,
+// plan bitince callback icinde m.model->decode ile cozulur
+bool meterRead(Meter &m, MbDoneCallback onDone)
+{
+  const MeterReadSpan &rd = m.plan.reads[m.planStep];
+  return modbusReadHoldingRegisters(m.slaveAddr, rd.start, rd.qty,
+                                    &m.regs[rd.start - m.model->map->base], onDone, &m);
+}
+
+// Sadece durum register'i: baud taramasi ve devre acikken yoklama icin
+bool meterProbe(Meter &m, MbDoneCallback onDone)
+{
+  const MeterRegMap  &map = *m.model->map;
+  const MeterRegDesc &d   = map.f[MF_STATUS];
+  return modbusReadHoldingRegisters(m.slaveAddr, d.addr, d.words,
+                                    &m.regs[d.addr - map.base], onDone, &m);
+}
+
+// Istenen alanlari adrese gore siralar, aralarindaki bosluk kucukse ve
+// MB_MAX_READ_REGS asilmiyorsa ayni okumada birlestirir.
+void meterPlanReads(const MeterRegMap &map, uint16_t fields, MeterReadPlan &plan)
+{
+  uint8_t order[MF_COUNT];
+  uint8_t n = 0;
+
+  for (uint8_t f = 0; f < MF_COUNT; f++) {
+    if (!(fields & MF_BIT(f)) || map.f[f].words == 0) continue;
+
+    uint8_t j = n++;
+    while (j > 0 && map.f[order[j - 1]].addr > map.f[f].addr) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = f;
+  }
+
+  plan.count  = 0;
+  plan.fields = 0;
+
+  for (uint8_t k = 0; k < n; k++) {
+    const MeterRegDesc &d = map.f[order[k]];
+    uint16_t end = d.addr + d.words;
+
+    if (plan.count > 0) {
+      MeterReadSpan &cur = plan.reads[plan.count - 1];
+      uint16_t curEnd = cur.start + cur.qty;
+      if (d.addr <= curEnd + MB_PLAN_MERGE_GAP_REGS && end - cur.start <= MB_MAX_READ_REGS) {
+        if (end > curEnd) cur.qty = (uint8_t)(end - cur.start);
+        cur.fields |= MF_BIT(order[k]);
+        plan.fields |= MF_BIT(order[k]);
+        continue;
+      }
+    }
+
+    MeterReadSpan &rd = plan.reads[plan.count++];
+    rd.start  = d.addr;
+    rd.qty    = d.words;
+    rd.fields = MF_BIT(order[k]);
+    plan.fields |= rd.fields;
   }
-  out.statusFlags = regs[0];
-  uint16_t svH = regs[1];
-  uint16_t svL = regs[2];
-  uint16_t tvH = regs[3];
-  uint16_t tvL = regs[4];
-  out.sessionVolCl = ((uint32_t)svH << 16) | svL;
-  out.totalVolCl   = ((uint32_t)tvH << 16) | tvL;
-  out.flowRateClm  = regs[5];
-  return true;
 }
 
 // -----------------------------------------------------------------------------
@@ -1333,7 +4771,7 @@ bool meterRead(MeterData &out)
 void showInfoMessage(const String &title, const String &line1, const String &line2,
                      uint8_t retScreenState, uint32_t durationMs)
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar(title.c_str());
 
   int16_t sw = spr.width();
@@ -1350,7 +4788,7 @@ void showInfoMessage(const String &title, const String &line1, const String &lin
   if (line2.length() > 0)
     spr.drawString(line2, sw / 2, centerY + 10);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 
   infoMsg.title        = title;
   infoMsg.line1        = line1;
@@ -1367,7 +4805,7 @@ void showInfoMessage(const String &title, const String &line1, const String &lin
 // -----------------------------------------------------------------------------
 void drawSetupMenu()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar(getScreenTitle(SCR_SETUP_MENU));
 
   int16_t sw = spr.width();
@@ -1401,7 +4839,7 @@ void drawSetupMenu()
     drawButton((ButtonId)i, false);
   }
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -1422,6 +4860,7 @@ void drawButton(ButtonId id, bool pressed)
 
   spr.fillRoundRect(b.x, b.y, b.w, b.h, 6, fillColor);
   spr.drawRoundRect(b.x, b.y, b.w, b.h, 6, borderColor);
+  sprMarkDirty(b.x, b.y, b.w, b.h);
 
   spr.setTextDatum(ML_DATUM);   // Soldan hizalı, ortalanmış yükseklik
   spr.setTextFont(FONT_MAIN);
@@ -1466,6 +4905,7 @@ bool readTouchPress(int16_t &x, int16_t &y)
 {
   static bool wasTouched = false;
 
+  lcdDmaWait();   // dokunmatik ayni SPI hattinda
   bool nowTouched = ts.touched();
 
   if (nowTouched)
@@ -1540,10 +4980,10 @@ void handleTouchOnSetupMenu()
 void handleButtonPress(ButtonId id)
 {
   drawButton(id, true);
-  spr.pushSprite(0, 0);
+  sprPresent();
   delay(120);
   drawButton(id, false);
-  spr.pushSprite(0, 0);
+  sprPresent();
 
   switch (id)
   {
@@ -1648,7 +5088,7 @@ void kbStart(const String &title, const String &hint, String *target, uint16_t m
 // -----------------------------------------------------------------------------
 void drawTextInputScreen()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar(textInput.title.c_str());
 
   int16_t sw = spr.width();
@@ -1676,7 +5116,7 @@ void drawTextInputScreen()
   kbBuildLayout();
   kbDrawKeyboard();
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -1687,6 +5127,7 @@ void kbDrawTextLine()
   int16_t sw = spr.width();
 
   spr.fillRect(10, KB_BOX_Y + 2, sw - 20, KB_BOX_H - 4, TFT_BLACK);
+  sprMarkDirty(10, KB_BOX_Y + 2, sw - 20, KB_BOX_H - 4);
 
   spr.setTextDatum(TL_DATUM);
   spr.setTextFont(FONT_MAIN);
@@ -2039,6 +5480,7 @@ void kbBuildLayout()
 // -----------------------------------------------------------------------------
 void kbDrawKeyboard()
 {
+  sprMarkDirty(0, KB_TOP_Y, spr.width(), spr.height() - KB_TOP_Y);
   for (uint8_t i = 0; i < kbKeyCount; i++)
   {
     kbDrawKey(i, false);
@@ -2060,6 +5502,7 @@ void kbDrawKey(uint8_t index, bool pressed)
 
   spr.fillRoundRect(k.x, k.y, k.w, k.h, 4, fillColor);
   spr.drawRoundRect(k.x, k.y, k.w, k.h, 4, borderColor);
+  sprMarkDirty(k.x, k.y, k.w, k.h);
 
   spr.setTextDatum(MC_DATUM);
   spr.setTextFont(FONT_MAIN);
@@ -2129,7 +5572,7 @@ void handleKeyboardTouch()
   if (idx >= 0)
   {
     kbProcessKey((uint8_t)idx);
-    spr.pushSprite(0, 0);
+    sprPresent();
   }
 }
 
@@ -2143,10 +5586,10 @@ void kbProcessKey(uint8_t index)
   KeyboardKey &k = kbKeys[index];
 
   kbDrawKey(index, true);
-  spr.pushSprite(0, 0);
+  sprPresent();
   delay(80);
   kbDrawKey(index, false);
-  spr.pushSprite(0, 0);
+  sprPresent();
 
   switch (k.type)
   {
@@ -2192,14 +5635,14 @@ void kbProcessKey(uint8_t index)
 
           int16_t sw = spr.width();
           int16_t sh = spr.height();
-          spr.fillSprite(TFT_BLACK);
+          sprClear(TFT_BLACK);
           drawTopBar("WiFi");
           spr.setTextDatum(MC_DATUM);
           spr.setTextFont(FONT_MAIN);
           spr.setTextColor(TFT_WHITE, TFT_BLACK);
           spr.drawString(ssid, sw / 2, sh / 2 - 10);
           spr.drawString("agina baglaniliyor...", sw / 2, sh / 2 + 10);
-          spr.pushSprite(0, 0);
+          sprPresent();
 
           bool okConn = wifiAttemptConnectBlocking(ssid, kbBuffer);
 
@@ -2236,14 +5679,15 @@ void kbProcessKey(uint8_t index)
       }
       else if (textInputPurpose == TIP_DRIVER_PLATE)
       {
-        if (driverCurrentUid.length() > 0)
+        if (driverCurrentUid.len > 0)
         {
           bool ok = configAddOrUpdateDriver(driverCurrentUid, kbBuffer, true);
           if (ok)
           {
-            driverScreenInfo = "Kaydedildi: " + driverCurrentUid + " -> " + kbBuffer;
+            String uidHex = cardUidToHex(driverCurrentUid);
+            driverScreenInfo = "Kaydedildi: " + uidHex + " -> " + kbBuffer;
             Serial.print(F("Sofor kart kaydedildi: UID="));
-            Serial.print(driverCurrentUid);
+            Serial.print(uidHex);
             Serial.print(F(" Plaka="));
             Serial.println(kbBuffer);
 
@@ -2251,8 +5695,8 @@ void kbProcessKey(uint8_t index)
             textInputPurpose = TIP_NONE;
 
             String line1 = "Sofor kart kaydedildi";
-            String line2 = driverCurrentUid + " / " + kbBuffer;
-            driverCurrentUid = "";
+            String line2 = uidHex + " / " + kbBuffer;
+            driverCurrentUid.len = 0;
             showInfoMessage("Sofor Kart", line1, line2, SCR_SETUP_MENU, 1500);
             return;
           }
@@ -2306,7 +5750,7 @@ void kbProcessKey(uint8_t index)
       break;
   }
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -2316,13 +5760,13 @@ void startWifiSettingsScreen()
 {
   currentScreen = SCR_WIFI_SETTINGS;
 
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar("WiFi Ayarlari");
   spr.setTextDatum(MC_DATUM);
   spr.setTextFont(FONT_MAIN);
   spr.setTextColor(TFT_WHITE, TFT_BLACK);
   spr.drawString("WiFi aglari taraniyor...", spr.width() / 2, spr.height() / 2);
-  spr.pushSprite(0, 0);
+  sprPresent();
 
   wifiScanNetworks();
   drawWifiSettingsScreen();
@@ -2368,7 +5812,7 @@ void wifiScanNetworks()
 // -----------------------------------------------------------------------------
 void drawWifiSettingsScreen()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar("WiFi Ayarlari");
 
   int16_t sw = spr.width();
@@ -2419,7 +5863,7 @@ void drawWifiSettingsScreen()
   spr.drawRoundRect(downX, btnY, btnW, btnH, 5, TFT_WHITE);
   spr.drawString("Asagi", downX + btnW / 2, btnY + btnH / 2);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -2438,6 +5882,7 @@ void drawWifiNetworksList()
   int16_t rowH = listH / WIFI_LIST_ROWS;
 
   spr.fillRect(0, listTop, sw, listH, TFT_BLACK);
+  sprMarkDirty(0, listTop, sw, listH);
 
   spr.setTextFont(FONT_MAIN);
   spr.setTextDatum(TL_DATUM);
@@ -2515,7 +5960,7 @@ void handleTouchOnWifiSettings()
       {
         wifiListFirstIndex--;
         drawWifiNetworksList();
-        spr.pushSprite(0, 0);
+        sprPresent();
       }
       return;
     }
@@ -2527,7 +5972,7 @@ void handleTouchOnWifiSettings()
       {
         wifiListFirstIndex++;
         drawWifiNetworksList();
-        spr.pushSprite(0, 0);
+        sprPresent();
       }
       return;
     }
@@ -2547,7 +5992,7 @@ void handleTouchOnWifiSettings()
     {
       wifiSelectedIndex = idx;
       drawWifiNetworksList();
-      spr.pushSprite(0, 0);
+      sprPresent();
 
       Serial.print(F("WiFi ag secildi: "));
       Serial.println(wifiScanList[idx].ssid);
@@ -2596,7 +6041,7 @@ void startPhoneApiScreen()
 // -----------------------------------------------------------------------------
 void drawPhoneApiScreen()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar("Telefon / API");
 
   int16_t sw = spr.width();
@@ -2658,7 +6103,7 @@ void drawPhoneApiScreen()
   spr.drawRoundRect(saveX, btnY, btnW, btnH, 5, TFT_WHITE);
   spr.drawString("Kaydet", saveX + btnW / 2, btnY + btnH / 2);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -2765,19 +6210,97 @@ void handleTouchOnPhoneApi()
 }
 
 // -----------------------------------------------------------------------------
-// RFID Yardimci: UID'yi hex string'e çevir (AA:BB:CC:DD)
+// RFID kart algilama zamanlayicisi
 // -----------------------------------------------------------------------------
-String uidToHexString(const MFRC522::Uid &uid)
+void IRAM_ATTR rfidIrqIsr()
 {
-  String s;
-  for (byte i = 0; i < uid.size; i++)
-  {
-    if (i > 0) s += ":";
-    if (uid.uidByte[i] < 0x10) s += "0";
-    s += String(uid.uidByte[i], HEX);
+  g_rfid.irqFired = true;
+}
+
+// REQA'yi baslatir, cevabi beklemez; kart cevap verirse RxIRq (ve IRQ pini)
+void rfidKickReqa()
+{
+  mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);       // bekleyen IRQ'lari sil
+  mfrc522.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80);    // FIFO'yu bosalt
+  mfrc522.PCD_WriteRegister(MFRC522::FIFODataReg, MFRC522::PICC_CMD_REQA);
+  mfrc522.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Transceive);
+  mfrc522.PCD_WriteRegister(MFRC522::BitFramingReg, 0x87);   // StartSend, 7 bit
+  g_rfid.kicked = true;
+}
+
+void rfidInit()
+{
+  SPI.begin(RFID_SCK, RFID_MISO, RFID_MOSI, RFID_SS);
+  mfrc522.PCD_Init();
+  Serial.println(F("MFRC522 baslatildi (ayri SPI hatti, VSPI)."));
+  mfrc522.PCD_DumpVersionToSerial();
+
+  memset((void *)&g_rfid, 0, sizeof(g_rfid));
+
+  if (RFID_IRQ >= 0) {
+    pinMode(RFID_IRQ, INPUT_PULLUP);
+    mfrc522.PCD_WriteRegister(MFRC522::ComIEnReg, 0xA0);     // IRqInv + RxIEn: aktif dusuk
+    attachInterrupt(digitalPinToInterrupt(RFID_IRQ), rfidIrqIsr, FALLING);
+    g_rfid.irqMode = true;
+  }
+  rfidKickReqa();
+
+  Serial.printf("RFID sorgu: %u ms, %s\n", RFID_POLL_MS,
+                g_rfid.irqMode ? "IRQ destekli" : "periyodik");
+}
+
+// Kart gosterildiyse ikili UID'yi verir ve karti HALT'a alir (kart kaldirilip
+// tekrar gosterilene kadar bir daha cevap vermez). Her ekran kendi
+// dongusunde cagirir; sorgu hizi ekranlar arasinda ortaktir.
+bool rfidTakeCard(CardUid &uid)
+{
+  uint32_t now = millis();
+
+  if (g_rfid.irqMode) {
+    // Cevap gelmediyse kart yok ya da REQA zaman asimina ugradi
+    if (!g_rfid.irqFired && now - g_rfid.lastPollMs < RFID_POLL_MS) return false;
+  } else {
+    if (now - g_rfid.lastPollMs < RFID_POLL_MS) return false;
+  }
+  g_rfid.lastPollMs = now;
+  g_rfid.polls++;
+
+  uint32_t t0 = micros();
+  bool answered;
+  if (g_rfid.irqMode) {
+    answered = g_rfid.irqFired;
+    g_rfid.irqFired = false;
+  } else {
+    // RxIRq: onceki REQA'ya kart cevap verdi (READY)
+    answered = g_rfid.kicked && (mfrc522.PCD_ReadRegister(MFRC522::ComIrqReg) & 0x20);
   }
-  s.toUpperCase();
-  return s;
+  g_rfid.kicked = false;
+
+  bool ok = answered && mfrc522.PICC_ReadCardSerial();
+  if (ok) {
+    uid.len = mfrc522.uid.size > CARD_UID_MAX ? CARD_UID_MAX : mfrc522.uid.size;
+    memcpy(uid.b, mfrc522.uid.uidByte, uid.len);
+    mfrc522.PICC_HaltA();
+    mfrc522.PCD_StopCrypto1();
+    g_rfid.cards++;
+  }
+  if (answered && g_rfid.irqMode) {
+    // Okuma sirasindaki cevaplar da IRQ pinini dusurdu: bayrak sifirlanir
+    mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);
+    g_rfid.irqFired = false;
+  }
+  if (!ok) rfidKickReqa();
+  g_rfid.busyUs += micros() - t0;
+
+  return ok;
+}
+
+void rfidPrintStats()
+{
+  Serial.printf("RFID: %s, %lu sorgu, %lu kart, sorgu basina ort %lu us\n",
+                g_rfid.irqMode ? "IRQ" : "periyodik",
+                (unsigned long)g_rfid.polls, (unsigned long)g_rfid.cards,
+                (unsigned long)(g_rfid.polls ? g_rfid.busyUs / g_rfid.polls : 0));
 }
 
 // -----------------------------------------------------------------------------
@@ -2797,7 +6320,7 @@ void drawAdminCardScreen(const String &uidHex)
 {
   (void)uidHex; // artik parametreyi kullanmiyoruz
 
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar("Yonetici RFID");
 
   int16_t sw = spr.width();
@@ -2811,8 +6334,8 @@ void drawAdminCardScreen(const String &uidHex)
 
   // Mevcut yonetici kart bilgisini goster
   String currentUid;
-  if (config.adminCard.isSet && config.adminCard.uidHex.length() > 0)
-    currentUid = config.adminCard.uidHex;
+  if (config.adminCard.isSet)
+    currentUid = cardUidToHex(config.adminCard.uid);
   else
     currentUid = "Tanimlanmadi";
 
@@ -2840,7 +6363,7 @@ void drawAdminCardScreen(const String &uidHex)
   spr.setTextColor(TFT_WHITE, TFT_BLUE);
   spr.drawString("Geri", backX + btnW / 2, btnY + btnH / 2);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -2871,33 +6394,18 @@ void handleTouchOnAdminCard()
     }
   }
 
-  spiUseRFID();
-  if (!mfrc522.PICC_IsNewCardPresent())
-  {
-    spiUseTFT();
-    return;
-  }
-  if (!mfrc522.PICC_ReadCardSerial())
-  {
-    spiUseTFT();
-    return;
-  }
-
-  String uidHex = uidToHexString(mfrc522.uid);
+  CardUid uid;
+  if (!rfidTakeCard(uid)) return;
 
+  String uidHex = cardUidToHex(uid);
   Serial.print(F("Admin kart okundu, UID = "));
   Serial.println(uidHex);
 
-  configSetAdminCard(uidHex, true);
+  configSetAdminCard(uid, true);
   adminLastUid = uidHex;
 
   Serial.println(F("Admin kart NVS'ye kaydedildi."));
 
-  mfrc522.PICC_HaltA();
-  mfrc522.PCD_StopCrypto1();
-
-  spiUseTFT();
-
   String line1 = "Yeni yonetici karti:";
   String line2 = uidHex;
   // Islemi bitirince tekrar RFID menusu'ne don
@@ -2918,7 +6426,7 @@ void startDriverMenuScreen()
 // -----------------------------------------------------------------------------
 void drawDriverMenuScreen()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar("RFID Ayarlari");
 
   int16_t sw = spr.width();
@@ -3009,7 +6517,7 @@ void drawDriverMenuScreen()
   spr.setTextColor(TFT_WHITE, TFT_BLUE);
   spr.drawString("Geri", backX + btnW2 / 2, btnY2 + btnH2 / 2);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -3073,7 +6581,7 @@ void handleTouchOnDriverMenu()
 // -----------------------------------------------------------------------------
 void startDriverCardScreen()
 {
-  driverCurrentUid.clear();
+  driverCurrentUid.len = 0;
   driverPlateBuffer.clear();
   driverScreenInfo = "Sofor kartinizi okutun";
   currentScreen = SCR_DRIVER_CARD;
@@ -3085,7 +6593,7 @@ void startDriverCardScreen()
 // -----------------------------------------------------------------------------
 void drawDriverCardScreen(const String &infoLine)
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
     drawTopBar(getScreenTitle(SCR_DRIVER_CARD));
 
   int16_t sw = spr.width();
@@ -3125,7 +6633,7 @@ void drawDriverCardScreen(const String &infoLine)
   spr.setTextColor(TFT_WHITE, TFT_BLUE);
   spr.drawString("Geri", backX + btnW / 2, btnY + btnH / 2);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -3156,33 +6664,17 @@ void handleTouchOnDriverCard()
     }
   }
 
-  if (driverCurrentUid.length() == 0)
+  if (driverCurrentUid.len == 0)
   {
-    spiUseRFID();
-    if (!mfrc522.PICC_IsNewCardPresent())
-    {
-      spiUseTFT();
-      return;
-    }
-    if (!mfrc522.PICC_ReadCardSerial())
-    {
-      spiUseTFT();
-      return;
-    }
-
-    driverCurrentUid = uidToHexString(mfrc522.uid);
+    if (!rfidTakeCard(driverCurrentUid)) return;
 
+    String uidHex = cardUidToHex(driverCurrentUid);
     Serial.print(F("Sofor kart okundu, UID = "));
-    Serial.println(driverCurrentUid);
-
-    mfrc522.PICC_HaltA();
-    mfrc522.PCD_StopCrypto1();
-
-    spiUseTFT();
+    Serial.println(uidHex);
 
     driverPlateBuffer = "";
-    String hint = "Kart: " + driverCurrentUid;
-    kbStart("Plaka", hint, &driverPlateBuffer, 16,
+    String hint = "Kart: " + uidHex;
+    kbStart("Plaka", hint, &driverPlateBuffer, DRIVER_PLATE_LEN - 1,
             SCR_DRIVER_CARD, TIP_DRIVER_PLATE);
   }
 }
@@ -3202,7 +6694,7 @@ void startDriverListScreen()
 // -----------------------------------------------------------------------------
 void drawDriverListScreen()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar("Kayitli RFID ve Plakalar");
 
   int16_t sw = spr.width();
@@ -3213,7 +6705,7 @@ void drawDriverListScreen()
 
   int16_t headerY = TOP_BAR_H + 4;
 
-  if (config.drivers.count == 0)
+  if (g_drivers.live == 0)
   {
     spr.setTextColor(TFT_YELLOW, TFT_BLACK);
     spr.drawString("Kayitli kart yok.", 8, headerY);
@@ -3229,12 +6721,14 @@ void drawDriverListScreen()
 
     spr.setTextColor(TFT_WHITE, TFT_BLACK);
 
-    for (int i = driverListFirstIndex; i < config.drivers.count; i++)
+    for (int i = driverListFirstIndex; i < (int)g_drivers.count; i++)
     {
       if (y > listBottom - DRIVER_LIST_ROW_H) break;
 
-      String line = config.drivers.items[i].uidHex + "  " +
-                    config.drivers.items[i].plate;
+      const DriverRecord &r = g_drivers.recs[i];
+      if (r.uid.len == 0) continue;   // bozuk sayfadan kalan bos kayit
+
+      String line = cardUidToHex(r.uid) + "  " + r.plate;
       spr.drawString(line, 8, y);
       y += DRIVER_LIST_ROW_H;
     }
@@ -3273,7 +6767,7 @@ void drawDriverListScreen()
   spr.drawRoundRect(downX, btnY, btnW, btnH, 5, TFT_WHITE);
   spr.drawString("Asagi", downX + btnW / 2, btnY + btnH / 2);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -3325,7 +6819,7 @@ void handleTouchOnDriverList()
     if (x >= downX && x <= downX + btnW &&
         y >= btnY && y <= btnY + btnH)
     {
-      if (config.drivers.count > 0)
+      if (g_drivers.count > 0)
       {
         int16_t headerY    = TOP_BAR_H + 4;
         int16_t listTop    = headerY + 16;
@@ -3333,7 +6827,7 @@ void handleTouchOnDriverList()
         int    visibleRows = (listBottom - listTop) / DRIVER_LIST_ROW_H;
         if (visibleRows < 1) visibleRows = 1;
 
-        if (driverListFirstIndex + visibleRows < config.drivers.count)
+        if (driverListFirstIndex + visibleRows < (int)g_drivers.count)
         {
           driverListFirstIndex++;
           drawDriverListScreen();
@@ -3349,7 +6843,7 @@ void handleTouchOnDriverList()
 // -----------------------------------------------------------------------------
 void drawFactoryResetConfirmScreen()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar("Factory Reset");
 
   int16_t sw = spr.width();
@@ -3386,7 +6880,7 @@ void drawFactoryResetConfirmScreen()
   spr.setTextColor(TFT_WHITE, TFT_RED);
   spr.drawString("Sifirla", resetX + btnW / 2, btnY + btnH / 2);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 // -----------------------------------------------------------------------------
@@ -3434,9 +6928,10 @@ void handleTouchOnFactoryResetConfirm()
 // -----------------------------------------------------------------------------
 void doFactoryReset()
 {
-  Serial.println(F("FACTORY RESET: NVS siliniyor ve yeniden baslatiliyor..."));
+  Serial.println(F("FACTORY RESET: NVS ve sofor deposu siliniyor, yeniden baslatiliyor..."));
 
   WiFi.disconnect(true, true);
+  driverStoreErase();
   esp_err_t err = nvs_flash_erase();
   if (err != ESP_OK)
   {
@@ -3446,12 +6941,89 @@ void doFactoryReset()
   ESP.restart();
 }
 
+// -----------------------------------------------------------------------------
+// Buyuk rakam gostergesi (7 segment)
+// -----------------------------------------------------------------------------
+const uint8_t SEG_DIGIT_MASK[10] = { 0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F };
+const uint8_t SEG_MASK_MINUS     = 0x40;
+
+// Ondalik noktasi icin tamsayi ve ondalik haneler arasinda t + gap bosluk
+int16_t segCellX(const SegDisplay &d, uint8_t i)
+{
+  int16_t x = d.x + i * (d.w + d.gap);
+  if (i >= d.digits - d.decimals) x += d.t + d.gap;
+  return x;
+}
+
+void segDrawCell(SegDisplay &d, uint8_t i, uint8_t mask)
+{
+  int16_t x = segCellX(d, i);
+  int16_t y = d.y;
+  int16_t w = d.w, h = d.h, t = d.t;
+  int16_t half = h / 2;
+
+  spr.fillRect(x, y, w, h, d.bg);
+  if (mask & 0x01) spr.fillRect(x + t,     y,                w - 2 * t, t,            d.fg);   // a
+  if (mask & 0x02) spr.fillRect(x + w - t, y + t,            t,         half - t,     d.fg);   // b
+  if (mask & 0x04) spr.fillRect(x + w - t, y + half,         t,         half - t,     d.fg);   // c
+  if (mask & 0x08) spr.fillRect(x + t,     y + h - t,        w - 2 * t, t,            d.fg);   // d
+  if (mask & 0x10) spr.fillRect(x,         y + half,         t,         half - t,     d.fg);   // e
+  if (mask & 0x20) spr.fillRect(x,         y + t,            t,         half - t,     d.fg);   // f
+  if (mask & 0x40) spr.fillRect(x + t,     y + half - t / 2, w - 2 * t, t,            d.fg);   // g
+  sprMarkDirty(x, y, w, h);
+
+  d.shown[i] = mask;
+}
+
+// Tam ekran ciziminde: ondalik noktasi ve birim yazisi (sabit kisimlar);
+// hanelerin hepsi bir sonraki segDisplaySet'te cizilir
+void segDisplayBegin(SegDisplay &d, const char *unit)
+{
+  int16_t dpX = segCellX(d, d.digits - d.decimals) - d.t - d.gap / 2;
+  spr.fillRect(dpX, d.y + d.h - d.t, d.t, d.t, d.fg);
+
+  int16_t right = segCellX(d, d.digits - 1) + d.w;
+  spr.setTextFont(FONT_MAIN);
+  spr.setTextSize(2);
+  spr.setTextDatum(BL_DATUM);
+  spr.setTextColor(d.fg, d.bg);
+  spr.drawString(unit, right + 8, d.y + d.h);
+  spr.setTextSize(1);
+
+  d.valid = false;
+}
+
+void segDisplaySet(SegDisplay &d, uint32_t valueCenti)
+{
+  uint8_t masks[SEG_MAX_DIGITS];
+  uint8_t unitPos = d.digits - d.decimals - 1;   // birler hanesi
+  uint32_t v = valueCenti;
+
+  for (int8_t i = d.digits - 1; i >= 0; i--) {
+    masks[i] = SEG_DIGIT_MASK[v % 10];
+    v /= 10;
+  }
+
+  if (v != 0) {
+    // Sigmiyor: tum haneler "-"
+    for (uint8_t i = 0; i < d.digits; i++) masks[i] = SEG_MASK_MINUS;
+  } else {
+    // Bastaki sifirlar bos, birler hanesi her zaman gorunur
+    for (uint8_t i = 0; i < unitPos && masks[i] == SEG_DIGIT_MASK[0]; i++) masks[i] = 0;
+  }
+
+  for (uint8_t i = 0; i < d.digits; i++) {
+    if (!d.valid || masks[i] != d.shown[i]) segDrawCell(d, i, masks[i]);
+  }
+  d.valid = true;
+}
+
 // -----------------------------------------------------------------------------
 // Normal Calisma: IDLE / FUELING / SUMMARY
 // -----------------------------------------------------------------------------
 void drawIdleScreen()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar(getScreenTitle(SCR_IDLE));
 
   int16_t sw = spr.width();
@@ -3469,7 +7041,7 @@ void drawIdleScreen()
   spr.drawString("dolumu baslatabilirsiniz.", sw / 2, centerY + 16);
   spr.setTextSize(1);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 void handleTouchOnIdle()
@@ -3477,40 +7049,31 @@ void handleTouchOnIdle()
   // Simdilik dokunus ile bir sey yapmiyoruz.
 }
 
-void drawFuelingScreen(const MeterData &md)
+// full = false: ekranda zaten dolum ekrani var; sadece litre ve debi
+// gostergelerinin degisen haneleri yeniden cizilip gonderilir.
+void drawFuelingScreen(const MeterData &md, bool full)
 {
-  spr.fillSprite(TFT_BLACK);
-  drawTopBar(getScreenTitle(SCR_FUELING));
-
-  int16_t sw = spr.width();
-  int16_t sh = spr.height();
-
-  float sessionLiters = md.sessionVolCl / 100.0f;
-  float flowLpm       = md.flowRateClm  / 100.0f;
-
-  spr.setTextDatum(MC_DATUM);
-  spr.setTextFont(FONT_MAIN);
-  spr.setTextColor(TFT_WHITE, TFT_BLACK);
-
-  int16_t centerY = TOP_BAR_H + (sh - TOP_BAR_H - BOTTOM_BAR_H) / 2;
-
-  char buf[32];
-
-  // Plaka / Toplam / Debi ortada ve buyuk
-  spr.setTextSize(2);
+  if (full) {
+    sprClear(TFT_BLACK);
+    drawTopBar(getScreenTitle(SCR_FUELING));
 
-  String line1 = "Plaka: " + g_activeDriverPlate;
-  spr.drawString(line1, sw / 2, centerY - 24);
+    spr.setTextDatum(TC_DATUM);
+    spr.setTextFont(FONT_MAIN);
+    spr.setTextColor(TFT_WHITE, TFT_BLACK);
+    spr.setTextSize(2);
 
-  snprintf(buf, sizeof(buf), "Toplam: %.2f L", sessionLiters);
-  spr.drawString(buf, sw / 2, centerY);
+    String line1 = "Plaka: " + g_activeDriverPlate;
+    spr.drawString(line1, spr.width() / 2, TOP_BAR_H + 10);
+    spr.setTextSize(1);
 
-  snprintf(buf, sizeof(buf), "Debi: %.2f L/dk", flowLpm);
-  spr.drawString(buf, sw / 2, centerY + 24);
+    segDisplayBegin(g_segLiters, "L");
+    segDisplayBegin(g_segFlow, "L/dk");
+  }
 
-  spr.setTextSize(1);
+  segDisplaySet(g_segLiters, md.sessionVolCl);
+  segDisplaySet(g_segFlow, md.flowRateClm);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 void handleTouchOnFueling()
@@ -3520,7 +7083,7 @@ void handleTouchOnFueling()
 
 void drawFuelSummaryScreen()
 {
-  spr.fillSprite(TFT_BLACK);
+  sprClear(TFT_BLACK);
   drawTopBar(getScreenTitle(SCR_FUEL_SUMMARY));
 
   int16_t sw = spr.width();
@@ -3546,7 +7109,7 @@ void drawFuelSummaryScreen()
 
   spr.setTextSize(1);
 
-  spr.pushSprite(0, 0);
+  sprPresent();
 }
 
 void handleTouchOnFuelSummary()
@@ -3560,70 +7123,565 @@ void handleTouchOnFuelSummary()
   }
 }
 
-// Modbus'i periyodik poll eden fonksiyon
+// Bus zamanlayici: oturumu acik sayaclari sirayla (round-robin) poll eder.
+// Hatta ayni anda tek islem oldugu icin bir sayacin en kotu yenilenme suresi
+// max(m.pollIntervalMs, N * (islem suresi + g_mbT35Us)) ile
+// sinirlidir; N sayac sirayla birer kez poll edilmeden hicbiri ikinci kez alinmaz.
 void handleMeterPolling()
 {
-  if (currentScreen != SCR_FUELING) return;
+  if (!mbReady()) return;
+
+  // Dolum baslatma istegi bekliyorsa bus ona birakilir
+  if (sessionStartWaitingForBus()) return;
 
   unsigned long now = millis();
-  if (now - g_lastMeterPollMs < METER_POLL_INTERVAL_MS) return;
-  g_lastMeterPollMs = now;
+  for (uint8_t n = 0; n < METER_COUNT; n++)
+  {
+    uint8_t i = (g_busNextMeter + n) % METER_COUNT;
+    Meter &m = g_meters[i];
+
+    if (!m.sessionActive) continue;
+    if (now - m.lastPollMs < meterNextDelayMs(m)) continue;
+
+    // Devre acikken tam okuma yerine tek register'lik yoklama yapilir
+    bool ok = m.circuitOpen ? meterProbe(m, onMeterProbeDone)
+                            : meterRead(m, onMeterPollDone);
+    if (!ok) return;
+
+    m.lastPollMs = now;
+    m.stats.polls++;
+    if (m.failStreak) m.stats.retries++;
+    g_busNextMeter = (i + 1) % METER_COUNT;
+    return;
+  }
+}
+
+void meterUpdateStats(Meter &m, MbResult result)
+{
+  if (result != MB_RESULT_OK) {
+    m.stats.failCount++;
+    switch (result) {
+      case MB_RESULT_TIMEOUT:   m.stats.timeouts++;   break;
+      case MB_RESULT_CRC:       m.stats.crcErrors++;  break;
+      case MB_RESULT_EXCEPTION: m.stats.exceptions++; break;
+      default:                  m.stats.badFrames++;  break;
+    }
+    return;
+  }
+
+  uint32_t latencyUs = g_mbLastFrameEndUs - g_mb.submitUs;
+  m.stats.okCount++;
+  m.stats.lastLatencyUs = latencyUs;
+  if (latencyUs > m.stats.maxLatencyUs) m.stats.maxLatencyUs = latencyUs;
+  m.stats.lastOkMs = millis();
+
+  uint32_t bucket = latencyUs / 1000;
+  if (bucket >= METER_LAT_BUCKETS) bucket = METER_LAT_BUCKETS - 1;
+  if (m.stats.latencyHist[bucket] != 0xFFFF) m.stats.latencyHist[bucket]++;
+}
+
+// Basarisiz islemden sonra bir sonraki denemenin ne zaman yapilacagini secer.
+// Sadece durum degisikliklerinde log basilir; olu bir sayac hatti
+// log ile doldurmaz.
+void meterOnFailure(Meter &m, MbResult result)
+{
+  if (m.failStreak < 0xFF) m.failStreak++;
+
+  if (result == MB_RESULT_CRC && m.crcRetries < MB_RETRY_POLICY.crcImmediateRetries) {
+    m.crcRetries++;
+    m.retryDelayMs = 0;
+    return;
+  }
+  m.crcRetries = 0;
+
+  if (m.failStreak >= MB_RETRY_POLICY.openAfterFailures) {
+    m.circuitOpen = true;
+    m.stats.circuitOpens++;
+    if (!g_mbLogMuted) {
+      Serial.printf("Sayac %u: %u ardisik hata (%s), devre acildi; %u ms'de bir yoklanacak\n",
+                    m.slaveAddr, m.failStreak, mbResultName(result),
+                    MB_RETRY_POLICY.openProbeIntervalMs);
+      meterPrintStats(m);
+    }
+    return;
+  }
+
+  if (result == MB_RESULT_TIMEOUT) {
+    uint32_t delayMs = (uint32_t)MB_RETRY_POLICY.backoffBaseMs << (m.failStreak - 1);
+    if (delayMs > MB_RETRY_POLICY.backoffMaxMs) delayMs = MB_RETRY_POLICY.backoffMaxMs;
+    m.retryDelayMs = (uint16_t)delayMs;
+  } else {
+    // Exception / bozuk cerceve: sayac canli, normal aralikla devam
+    m.retryDelayMs = m.pollIntervalMs;
+  }
+
+  if (m.failStreak == 1 && !g_mbLogMuted) {
+    Serial.printf("meterRead hata (slave %u, %s), %u ms sonra tekrar\n",
+                  m.slaveAddr, mbResultName(result), m.retryDelayMs);
+  }
+}
+
+void meterResetHealth(Meter &m)
+{
+  if (m.circuitOpen && !g_mbLogMuted) {
+    Serial.printf("Sayac %u: cevap geldi, devre kapandi\n", m.slaveAddr);
+  } else if (m.failStreak > 1 && !g_mbLogMuted) {
+    Serial.printf("Sayac %u: %u hatadan sonra cevap geldi\n", m.slaveAddr, m.failStreak);
+  }
+  m.failStreak   = 0;
+  m.crcRetries   = 0;
+  m.circuitOpen  = false;
+  m.retryDelayMs = 0;
+}
+
+uint32_t meterNextDelayMs(const Meter &m)
+{
+  if (m.planStep)    return 0;   // planin kalan okumalari beklemeden
+  if (m.circuitOpen) return MB_RETRY_POLICY.openProbeIntervalMs;
+  if (m.failStreak)  return m.retryDelayMs;
+  return m.pollIntervalMs;
+}
+
+void onMeterProbeDone(MbResult result, void *ctx)
+{
+  Meter &m = *(Meter *)ctx;
+  meterUpdateStats(m, result);
+  if (result != MB_RESULT_OK) return;
+
+  // Sayac geri geldi: tam okuma hemen yapilsin
+  meterResetHealth(m);
+  m.lastPollMs = millis() - m.pollIntervalMs;
+}
+
+// Histogramdan yuzdelik: kutunun ust siniri (ms) doner
+uint32_t meterLatencyPercentileMs(const MeterPollStats &st, uint8_t pct)
+{
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < METER_LAT_BUCKETS; i++) total += st.latencyHist[i];
+  if (total == 0) return 0;
+
+  uint32_t rank = (total * pct + 99) / 100;
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < METER_LAT_BUCKETS; i++) {
+    seen += st.latencyHist[i];
+    if (seen >= rank) return i + 1;
+  }
+  return METER_LAT_BUCKETS;
+}
+
+void meterPrintStats(const Meter &m)
+{
+  const MeterPollStats &st = m.stats;
+  Serial.printf("Sayac %u: poll %lu ok %lu | timeout %lu crc %lu exc %lu bozuk %lu | "
+                "tekrar %lu devre %lu\n",
+                m.slaveAddr, (unsigned long)st.polls, (unsigned long)st.okCount,
+                (unsigned long)st.timeouts, (unsigned long)st.crcErrors,
+                (unsigned long)st.exceptions, (unsigned long)st.badFrames,
+                (unsigned long)st.retries, (unsigned long)st.circuitOpens);
+  Serial.printf("Sayac %u: gecikme p50 %lu p90 %lu p99 %lu ms, max %lu us\n",
+                m.slaveAddr,
+                (unsigned long)meterLatencyPercentileMs(st, 50),
+                (unsigned long)meterLatencyPercentileMs(st, 90),
+                (unsigned long)meterLatencyPercentileMs(st, 99),
+                (unsigned long)st.maxLatencyUs);
+  Serial.printf("Sayac %u: poll araligi %u ms | ornek %u ms %lu, %u ms %lu, %u ms %lu, %u ms %lu\n",
+                m.slaveAddr, m.pollIntervalMs,
+                METER_POLL_FAST_MS,    (unsigned long)st.tierSamples[0],
+                METER_POLL_NORMAL_MS,  (unsigned long)st.tierSamples[1],
+                METER_POLL_STEADY_MS,  (unsigned long)st.tierSamples[2],
+                METER_POLL_NO_FLOW_MS, (unsigned long)st.tierSamples[3]);
+}
+
+void onMeterPollDone(MbResult result, void *ctx)
+{
+  Meter &m = *(Meter *)ctx;
+  meterUpdateStats(m, result);
+
+  if (result != MB_RESULT_OK) {
+    m.planStep = 0;   // sonraki deneme planin basindan
+    meterOnFailure(m, result);
+    return;
+  }
+  if (m.failStreak) meterResetHealth(m);
+
+  // Plan birden fazla okumaysa hepsi gelmeden cozulmez
+  if (++m.planStep < m.plan.count) return;
+  m.planStep = 0;
+
+  MeterData prev = m.data;
+  m.model->decode(m.regs, m.plan.fields, m.data);
+  m.sampleMs = millis();
+
+  uint16_t interval = meterChooseInterval(m, prev);
+  m.stats.tierSamples[meterIntervalTier(interval)]++;
+  if (interval != m.pollIntervalMs) {
+    if (!g_mbLogMuted) Serial.printf("Sayac %u: poll araligi %u ms\n", m.slaveAddr, interval);
+    m.pollIntervalMs = interval;
+  }
+
+  bool active = (m.data.statusFlags & STATUS_SESSION_ACTIVE_BIT) != 0;
+  bool ended  = m.sessionActive && !active;
+  m.sessionActive = active;
+
+  // Her dolum sonunda hat sagligi ozeti: kablo/sonlandirma ayari icin
+  if (ended && !g_mbLogMuted) meterPrintStats(m);
 
-  MeterData md;
-  if (!meterRead(md)) {
-    Serial.println(F("meterRead hata"));
+  meterPublish((uint8_t)(&m - g_meters));
+}
+
+// Oturum basinda: tahmin olculen degerden baslar
+void fuelEstReset(const MeterData &md, uint32_t nowMs)
+{
+  g_fuelEst.measCl   = md.sessionVolCl;
+  g_fuelEst.flowClm  = (md.statusFlags & STATUS_FLOW_ACTIVE_BIT) ? md.flowRateClm : 0;
+  g_fuelEst.shownCl  = md.sessionVolCl;
+  g_fuelEst.shownMs  = nowMs;
+  g_fuelEst.fracClMs = 0;
+  g_fuelEst.drawnCl  = md.sessionVolCl;
+  g_fuelEst.drawnMs  = nowMs;
+}
+
+// Yeni olcum: once tahmin ornek anina kadar eski debiyle ilerletilir,
+// sonra tavan ve debi yeni ornege gecer
+void fuelEstSample(const MeterData &md, uint32_t sampleMs)
+{
+  // Ornek, UI'in son hesabindan once alinmis olabilir (kuyrukta bekledi)
+  if ((int32_t)(sampleMs - g_fuelEst.shownMs) > 0) fuelEstAdvance(sampleMs);
+
+  uint32_t prevMeas = g_fuelEst.measCl;
+  g_fuelEst.measCl  = md.sessionVolCl;
+  g_fuelEst.flowClm = (md.statusFlags & STATUS_FLOW_ACTIVE_BIT) ? md.flowRateClm : 0;
+
+  if (g_fuelEst.shownCl < prevMeas && prevMeas <= g_fuelEst.measCl) {
+    g_fuelEst.shownCl  = prevMeas;
+    g_fuelEst.fracClMs = 0;
+  }
+  // Sayac geri gittiyse (yeniden baslatma vb.) tahmin de izler
+  if (g_fuelEst.shownCl > g_fuelEst.measCl) {
+    g_fuelEst.shownCl  = g_fuelEst.measCl;
+    g_fuelEst.fracClMs = 0;
+  }
+}
+
+// Tahmini simdiki ana ilerletir
+void fuelEstAdvance(uint32_t nowMs)
+{
+  uint32_t dt = nowMs - g_fuelEst.shownMs;
+  g_fuelEst.shownMs = nowMs;
+
+  if (g_fuelEst.shownCl >= g_fuelEst.measCl) {
+    g_fuelEst.fracClMs = 0;
     return;
   }
+  if (dt > 60000) dt = 60000;   // uint32 tasmasin (debi <= 65535 cl/dk)
+
+  g_fuelEst.fracClMs += (uint32_t)g_fuelEst.flowClm * dt;
+  uint32_t inc = g_fuelEst.fracClMs / 60000;
+  g_fuelEst.fracClMs -= inc * 60000;
+  if (inc == 0) return;
+
+  uint32_t room = g_fuelEst.measCl - g_fuelEst.shownCl;
+  if (inc >= room) {
+    inc = room;
+    g_fuelEst.fracClMs = 0;
+  }
+  g_fuelEst.shownCl += inc;
+}
+
+// UI tarafi: RS485 gorevinin olaylarini isler. Ayni sayacin birden fazla
+// ornegi birikmisse hepsi tahminciye verilir, sadece sonuncusu cizilir;
+// ornekler arasinda litre sayaci tahminle FUEL_COUNTER_FRAME_MS'de bir
+// ilerletilir.
+void handleMeterEvents()
+{
+  MeterEvent e;
+  while (meterEvtPop(e))
+  {
+    uint8_t i = e.meterIdx;
+
+    if (e.kind == METER_EVT_START_FAIL)
+    {
+      g_uiStartPending = false;
+      showInfoMessage("RS485", "Dolum baslatilamadi", "Baglanti hatasi", SCR_IDLE, 1500);
+      continue;
+    }
+
+    bool ended = g_uiMeterActive[i] && !e.sessionActive;
+    g_uiMeterActive[i] = e.sessionActive;
+    g_uiMeterData[i]   = e.data;
+
+    if (e.kind == METER_EVT_START_OK)
+    {
+      g_uiStartPending = false;
+      if (i == g_activeMeter)
+      {
+        g_lastSessionLiters = e.data.sessionVolCl / 100.0f;
+        currentScreen = SCR_FUELING;
+        fuelEstReset(e.data, millis());
+        drawFuelingScreen(e.data, true);
+        g_uiMeterDirty[i] = false;
+      }
+      continue;
+    }
+
+    // Ekran sadece gosterilen sayacin dolumunu izler
+    if (i != g_activeMeter || currentScreen != SCR_FUELING) continue;
+
+    g_lastSessionLiters = e.data.sessionVolCl / 100.0f;
+    g_uiMeterDirty[i] = true;
+    fuelEstSample(e.data, e.sampleMs);
+
+    // Oturum yeni bitti mi? Son deger tahminsiz, aynen cizilir
+    if (ended)
+    {
+      drawFuelingScreen(e.data, false);
+      g_uiMeterDirty[i] = false;
+
+      // Dolum bitti: tek bir ozet ekrani goster, sonra otomatik IDLE'a don
+      currentScreen = SCR_FUEL_SUMMARY;
+      g_fuelSummaryStartMs = millis();
+      drawFuelSummaryScreen();
+    }
+  }
+
+  if (currentScreen != SCR_FUELING) return;
+
+  uint32_t now = millis();
+  fuelEstAdvance(now);
+  bool moved    = g_fuelEst.shownCl != g_fuelEst.drawnCl;
+  bool frameDue = now - g_fuelEst.drawnMs >= FUEL_COUNTER_FRAME_MS;
+
+  if (g_uiMeterDirty[g_activeMeter] || (moved && frameDue))
+  {
+    g_uiMeterDirty[g_activeMeter] = false;
+    g_fuelEst.drawnCl = g_fuelEst.shownCl;
+    g_fuelEst.drawnMs = now;
+
+    MeterData md = g_uiMeterData[g_activeMeter];
+    md.sessionVolCl = g_fuelEst.shownCl;
+    drawFuelingScreen(md, false);
+  }
+}
+
+// Son ornege gore bir sonraki poll araligini secer:
+// baslangicta ve debi aniden degisince hizli; debi
+// oturunca ve akis durunca yavas. Boylece oturum sonu hizli yakalanir,
+// sabit dolumda bus daha az mesgul edilir.
+uint16_t meterChooseInterval(Meter &m, const MeterData &prev)
+{
+  const MeterData &md = m.data;
+
+  uint16_t delta = (md.flowRateClm > prev.flowRateClm) ? md.flowRateClm - prev.flowRateClm
+                                                       : prev.flowRateClm - md.flowRateClm;
+  if (delta > METER_FLOW_DELTA_CLM)
+    m.steadyCount = 0;
+  else if (m.steadyCount < 255)
+    m.steadyCount++;
+
+  if (millis() - m.sessionStartMs < METER_START_FAST_MS) return METER_POLL_FAST_MS;
+  if (m.steadyCount == 0) return METER_POLL_FAST_MS;
+
+  if ((md.statusFlags & STATUS_FLOW_ACTIVE_BIT) == 0) return METER_POLL_NO_FLOW_MS;
+  if (m.steadyCount >= METER_STEADY_SAMPLES) return METER_POLL_STEADY_MS;
+  return METER_POLL_NORMAL_MS;
+}
+
+// Poll araligi -> MeterPollStats::tierSamples indeksi
+uint8_t meterIntervalTier(uint16_t intervalMs)
+{
+  if (intervalMs <= METER_POLL_FAST_MS)   return 0;
+  if (intervalMs <= METER_POLL_NORMAL_MS) return 1;
+  if (intervalMs <= METER_POLL_STEADY_MS) return 2;
+  return 3;
+}
+
+// Oturumu acik olmayan ilk sayac; yoksa -1
+int meterFindIdle()
+{
+  for (uint8_t i = 0; i < METER_COUNT; i++)
+  {
+    if (!g_uiMeterActive[i]) return (int)i;
+  }
+  return -1;
+}
 
-  g_lastMeter = md;
-  float sessionLiters = md.sessionVolCl / 100.0f;
-  g_lastSessionLiters = sessionLiters;
+bool sessionStartWaitingForBus()
+{
+  return g_sessionStartPhase == SSP_QUEUED ||
+         g_sessionStartPhase == SSP_CMD_QUEUED ||
+         g_sessionStartPhase == SSP_STATUS_QUEUED ||
+         g_sessionStartPhase == SSP_VERIFY_QUEUED;
+}
 
-  drawFuelingScreen(md);
+// Dolum baslatma adimlari: bus bos oldugunda siradaki istek gonderilir.
+// Sayac FC17 destekliyorsa komut + ilk durum tek cercevede gider. FC17'yi
+// reddederse (illegal function) eski iki adimli yola (FC06 + FC03) dusulur.
+// Cevap kayip / bozuksa komut islenmis olabilir: baslatma komutu tekrar
+// gonderilmeden once durum okunur.
+void handleSessionStart()
+{
+  if (!sessionStartWaitingForBus()) return;
+  if (!mbReady()) return;
 
-  bool active = (md.statusFlags & STATUS_SESSION_ACTIVE_BIT) != 0;
+  Meter &m = g_meters[g_sessionStartMeter];
 
-  // Oturum yeni bitti mi?
-  if (g_sessionActive && !active)
+  if (g_sessionStartPhase == SSP_QUEUED)
   {
-    g_sessionActive = false;
+    if (!METER_USE_RW_MULTI || m.rwSupport == METER_RW_UNSUPPORTED)
+      g_sessionStartPhase = SSP_CMD_QUEUED;
+    else if (meterStartSessionRw(m, onSessionStartRwDone))
+      g_sessionStartPhase = SSP_RW_MULTI;
+  }
+  else if (g_sessionStartPhase == SSP_CMD_QUEUED)
+  {
+    if (meterStartSession(m, onSessionStartCmdDone))
+      g_sessionStartPhase = SSP_WRITE_CMD;
+  }
+  else if (g_sessionStartPhase == SSP_VERIFY_QUEUED)
+  {
+    if (meterRead(m, onSessionStartVerifyDone))
+      g_sessionStartPhase = SSP_VERIFY_STATUS;
+  }
+  else
+  {
+    if (meterRead(m, onSessionStartStatusDone))
+      g_sessionStartPhase = SSP_READ_STATUS;
+  }
+}
+
+// Komut kabul edildi: sayacin oturumu acik sayilir
+void sessionStartBegin(Meter &m)
+{
+  m.sessionActive     = true;
+  m.lastPollMs        = millis();
+  m.sessionStartMs    = m.lastPollMs;
+  m.pollIntervalMs    = METER_POLL_FAST_MS;
+  m.steadyCount       = 0;
+}
 
-    // Dolum bitti: tek bir ozet ekrani goster, sonra otomatik IDLE'a don
-    currentScreen = SCR_FUEL_SUMMARY;
-    g_fuelSummaryStartMs = millis();
-    drawFuelSummaryScreen();
+// Ilk durum (varsa) m.regs'te: dolum ekranina gec
+void sessionStartFinish(Meter &m, bool haveStatus)
+{
+  if (haveStatus)
+  {
+    // Ilk okuma planin ilk parcasidir; kalan alanlar ilk poll'da gelir
+    MeterData prev = m.data;
+    m.model->decode(m.regs, m.plan.reads[0].fields, m.data);
+    m.pollIntervalMs = meterChooseInterval(m, prev);
   }
   else
   {
-    g_sessionActive = active;
+    memset(&m.data, 0, sizeof(m.data));
   }
+  m.sampleMs = millis();
+
+  // Dolum baslatma cevabi geldiyse sayac canli: eski hata serisi unutulur
+  meterResetHealth(m);
+
+  g_sessionStartPhase = SSP_NONE;
+  sessionStartPublish(METER_EVT_START_OK, m);
 }
 
-// Normal mod RFID: Idle / Fueling / Summary
-void handleRfidInNormalMode()
+// Baslatma sonucu UI'a mutlaka ulasmali: kuyruk doluysa saklanir
+void sessionStartPublish(uint8_t kind, const Meter &m)
+{
+  g_sessionStartResult.kind          = kind;
+  g_sessionStartResult.meterIdx      = g_sessionStartMeter;
+  g_sessionStartResult.sessionActive = m.sessionActive;
+  g_sessionStartResult.data          = m.data;
+  g_sessionStartResult.sampleMs      = m.sampleMs;
+
+  g_sessionStartResultPending = !meterEvtPush(g_sessionStartResult);
+}
+
+void onSessionStartRwDone(MbResult result, void *ctx)
 {
-  spiUseRFID();
-  if (!mfrc522.PICC_IsNewCardPresent())
+  Meter &m = *(Meter *)ctx;
+
+  if (result == MB_RESULT_OK)
   {
-    spiUseTFT();
+    meterUpdateStats(m, result);
+    m.rwSupport = METER_RW_SUPPORTED;
+    sessionStartBegin(m);
+    sessionStartFinish(m, true);
     return;
   }
-  if (!mfrc522.PICC_ReadCardSerial())
+
+  meterUpdateStats(m, result);
+
+  if (result == MB_RESULT_EXCEPTION && g_mb.exceptionCode == MB_EX_ILLEGAL_FUNCTION)
   {
-    spiUseTFT();
+    if (!g_mbLogMuted) Serial.printf("Sayac %u FC17 desteklemiyor, iki adimli baslatma\n", m.slaveAddr);
+    m.rwSupport = METER_RW_UNSUPPORTED;
+    g_sessionStartPhase = SSP_CMD_QUEUED;
     return;
   }
 
-  String uidHex = uidToHexString(mfrc522.uid);
+  // Timeout / CRC / bozuk cerceve / diger exception: yazma islenmis olabilir,
+  // CONTROL_CMD tekrar gonderilmeden once durum okunur
+  g_sessionStartPhase = SSP_VERIFY_QUEUED;
+}
 
-  mfrc522.PICC_HaltA();
-  mfrc522.PCD_StopCrypto1();
-  spiUseTFT();
+// FC17 sonucu belirsizken okunan durum: oturum aciksa komut islenmis
+// demektir, tekrar gonderilmez; kapaliysa FC06 ile baslatilir
+void onSessionStartVerifyDone(MbResult result, void *ctx)
+{
+  Meter &m = *(Meter *)ctx;
+  meterUpdateStats(m, result);
 
-  Serial.print(F("Normal mod RFID: "));
-  Serial.println(uidHex);
+  if (result != MB_RESULT_OK)
+  {
+    g_sessionStartPhase = SSP_NONE;
+    sessionStartPublish(METER_EVT_START_FAIL, m);
+    return;
+  }
+
+  MeterData status = m.data;
+  m.model->decode(m.regs, m.plan.reads[0].fields, status);
+  if (status.statusFlags & STATUS_SESSION_ACTIVE_BIT)
+  {
+    if (!g_mbLogMuted) Serial.printf("Sayac %u: FC17 cevabi kayip ama oturum acik\n", m.slaveAddr);
+    sessionStartBegin(m);
+    sessionStartFinish(m, true);
+    return;
+  }
+
+  g_sessionStartPhase = SSP_CMD_QUEUED;
+}
+
+void onSessionStartCmdDone(MbResult result, void *ctx)
+{
+  Meter &m = *(Meter *)ctx;
+
+  if (result != MB_RESULT_OK)
+  {
+    g_sessionStartPhase = SSP_NONE;
+    sessionStartPublish(METER_EVT_START_FAIL, m);
+    return;
+  }
+
+  sessionStartBegin(m);
+  g_sessionStartPhase = SSP_STATUS_QUEUED;
+}
+
+void onSessionStartStatusDone(MbResult result, void *ctx)
+{
+  Meter &m = *(Meter *)ctx;
+  meterUpdateStats(m, result);
+  sessionStartFinish(m, result == MB_RESULT_OK);
+}
 
-  bool isAdmin = (config.adminCard.isSet && uidHex == config.adminCard.uidHex);
+// Normal mod RFID: Idle / Fueling / Summary
+void handleRfidInNormalMode()
+{
+  CardUid uid;
+  if (!rfidTakeCard(uid)) return;
+
+  char uidHex[3 * CARD_UID_MAX];
+  cardUidFormat(uid, uidHex, sizeof(uidHex));
+  Serial.printf("Normal mod RFID: %s\n", uidHex);
+
+  bool isAdmin = (config.adminCard.isSet && cardUidEqual(uid, config.adminCard.uid));
 
   if (isAdmin)
   {
@@ -3632,41 +7690,41 @@ void handleRfidInNormalMode()
     return;
   }
 
+  if (g_uiStartPending)
+  {
+    Serial.println(F("Dolum baslatma suruyor, kart yok sayildi."));
+    return;
+  }
+
   if (currentScreen == SCR_IDLE || currentScreen == SCR_FUEL_SUMMARY)
   {
-    int idx = findDriverIndexByUid(uidHex);
+    int idx = findDriverIndexByUid(uid);
     if (idx < 0)
     {
       showInfoMessage("Sofor Kart", "Kart tanimli degil", "", SCR_IDLE, 1500);
       return;
     }
 
-    g_activeDriverUid   = uidHex;
-    g_activeDriverPlate = config.drivers.items[idx].plate;
-
-    if (!meterStartSession())
+    int meterIdx = meterFindIdle();
+    if (meterIdx < 0)
     {
-      showInfoMessage("RS485", "Dolum baslatilamadi", "Baglanti hatasi", SCR_IDLE, 1500);
+      showInfoMessage("RS485", "Bos tabanca yok", "", SCR_IDLE, 1500);
       return;
     }
 
-    g_sessionActive     = true;
-    g_lastMeterPollMs   = 0;
+    g_activeDriverUid   = uid;
+    g_activeDriverPlate = g_drivers.recs[idx].plate;
+    g_activeMeter       = (uint8_t)meterIdx;
     g_lastSessionLiters = 0.0f;
 
-    MeterData md;
-    if (meterRead(md))
-    {
-      g_lastMeter = md;
-      g_lastSessionLiters = md.sessionVolCl / 100.0f;
-    }
-    else
+    // Komut RS485 gorevine gider; sonuc METER_EVT_START_OK / _FAIL olarak doner
+    MeterCmd cmd = { METER_CMD_START_SESSION, (uint8_t)meterIdx };
+    if (xQueueSend(g_meterCmdQueue, &cmd, 0) != pdTRUE)
     {
-      memset(&g_lastMeter, 0, sizeof(g_lastMeter));
+      showInfoMessage("RS485", "Dolum baslatilamadi", "Bus mesgul", SCR_IDLE, 1500);
+      return;
     }
-
-    currentScreen = SCR_FUELING;
-    drawFuelingScreen(g_lastMeter);
+    g_uiStartPending = true;
   }
 }
 